@@ -1,684 +1,717 @@
 #include "bpt.h"
 
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <time.h>
 
-#include <list>
+#include <vector>
 #include <algorithm>
-using std::swap;
-using std::binary_search;
-using std::lower_bound;
-using std::upper_bound;
 
-namespace bpt {
-
-/* custom compare operator for STL algorithms */
-OPERATOR_KEYCMP(index_t)
-OPERATOR_KEYCMP(record_t)
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
-/* helper iterating function */
-template<class T>
-inline typename T::child_t begin(T &node) {
-    return node.children; 
-}
-template<class T>
-inline typename T::child_t end(T &node) {
-    return node.children + node.n;
-}
+namespace bpt {
 
-/* helper searching function */
-inline index_t *find(internal_node_t &node, const key_t &key) {
-    if (key) {
-        return upper_bound(begin(node), end(node) - 1, key);
-    }
-    // because the end of the index range is an empty string, so if we search the empty key(when merge internal nodes), we need to return the second last one
-    if (node.n > 1) {
-        return node.children + node.n - 2;
+buffer_pool::buffer_pool(size_t c, size_t b)
+    : capacity(c), block_size(b)
+{
+    assert(capacity > 0);
+    frames = new frame_t[capacity];
+    blocks = new char[capacity * block_size];
+    lru.prev = lru.next = &lru;
+    for (size_t i = 0; i < capacity; i++) {
+        frames[i].data = blocks + i * block_size;
+        frames[i].offset = -1;
+        frames[i].size = 0;
+        frames[i].pin = 0;
+        frames[i].dirty = false;
+        frames[i].lsn = 0;
+        lru_push_front(&frames[i]);
     }
-    return begin(node);
-}
-inline record_t *find(leaf_node_t &node, const key_t &key) {
-    return lower_bound(begin(node), end(node), key);
 }
 
-bplus_tree::bplus_tree(const char *p, bool force_empty)
-    : fp(NULL), fp_level(0)
+buffer_pool::~buffer_pool()
 {
-    bzero(path, sizeof(path));
-    strcpy(path, p);
-
-    if (!force_empty)
-        // read tree from file
-        if (map(&meta, OFFSET_META) != 0)
-            force_empty = true;
+    delete[] frames;
+    delete[] blocks;
+}
 
-    if (force_empty) {
-        open_file("w+"); // truncate file
+frame_t *buffer_pool::find(off_t offset)
+{
+    std::unordered_map<off_t, frame_t *>::iterator i = table.find(offset);
+    if (i == table.end())
+        return NULL;
 
-        // create empty tree if file doesn't exist
-        init_from_empty();
-        close_file();
-    }
+    lru_remove(i->second);
+    lru_push_front(i->second);
+    return i->second;
 }
 
-int bplus_tree::search(const key_t& key, value_t *value) const
+frame_t *buffer_pool::victim() const
 {
-    leaf_node_t leaf;
-    map(&leaf, search_leaf(key));
+    for (frame_t *f = lru.prev; f != &lru; f = f->prev)
+        if (f->pin == 0)
+            return f;
 
-    // finding the record
-    record_t *record = find(leaf, key);
-    if (record != leaf.children + leaf.n) {
-        // always return the lower bound
-        *value = record->value;
+    return NULL;
+}
 
-        return keycmp(record->key, key);
-    } else {
-        return -1;
+void buffer_pool::clear()
+{
+    for (size_t i = 0; i < capacity; i++) {
+        frames[i].pin = 0;
+        detach(frames + i);
     }
 }
 
-int bplus_tree::search_range(key_t *left, const key_t &right,
-                             value_t *values, size_t max, bool *next) const
+void buffer_pool::attach(frame_t *frame, off_t offset)
 {
-    if (left == NULL || keycmp(*left, right) > 0)
-        return -1;
-
-    off_t off_left = search_leaf(*left);
-    off_t off_right = search_leaf(right);
-    off_t off = off_left;
-    size_t i = 0;
-    record_t *b, *e;
-
-    leaf_node_t leaf;
-    while (off != off_right && off != 0 && i < max) {
-        map(&leaf, off);
-
-        // start point
-        if (off_left == off) 
-            b = find(leaf, *left);
-        else
-            b = begin(leaf);
+    assert(frame->pin == 0);
+    if (frame->offset != -1)
+        table.erase(frame->offset);
+
+    frame->offset = offset;
+    frame->size = 0;
+    frame->dirty = false;
+    frame->lsn = 0;
+    table[offset] = frame;
+
+    lru_remove(frame);
+    lru_push_front(frame);
+}
 
-        // copy
-        e = leaf.children + leaf.n;
-        for (; b != e && i < max; ++b, ++i)
-            values[i] = b->value;
+void buffer_pool::detach(frame_t *frame)
+{
+    assert(frame->pin == 0);
+    if (frame->offset != -1)
+        table.erase(frame->offset);
+
+    frame->offset = -1;
+    frame->size = 0;
+    frame->dirty = false;
+    frame->lsn = 0;
+
+    // free frames are the first to be reused
+    lru_remove(frame);
+    frame->prev = lru.prev;
+    frame->next = &lru;
+    lru.prev->next = frame;
+    lru.prev = frame;
+}
 
-        off = leaf.next;
-    }
+void buffer_pool::lru_remove(frame_t *frame)
+{
+    frame->prev->next = frame->next;
+    frame->next->prev = frame->prev;
+}
 
-    // the last leaf
-    if (i < max) {
-        map(&leaf, off_right);
+void buffer_pool::lru_push_front(frame_t *frame)
+{
+    frame->prev = &lru;
+    frame->next = lru.next;
+    lru.next->prev = frame;
+    lru.next = frame;
+}
 
-        b = find(leaf, *left);
-        e = upper_bound(begin(leaf), end(leaf), right);
-        for (; b != e && i < max; ++b, ++i)
-            values[i] = b->value;
-    }
+latch_table::latch_table()
+{
+    for (size_t i = 0; i < sizeof(shards) / sizeof(shards[0]); i++)
+        pthread_mutex_init(&shards[i].mutex, NULL);
+}
 
-    // mark for next iteration
-    if (next != NULL) {
-        if (i == max && b != e) {
-            *next = true;
-            *left = b->key;
-        } else {
-            *next = false;
+latch_table::~latch_table()
+{
+    for (size_t i = 0; i < sizeof(shards) / sizeof(shards[0]); i++) {
+        shard_t &s = shards[i];
+        assert(s.table.empty());
+        for (size_t j = 0; j < s.spare.size(); j++) {
+            pthread_rwlock_destroy(&s.spare[j]->lock);
+            delete s.spare[j];
         }
+        pthread_mutex_destroy(&s.mutex);
     }
-
-    return i;
 }
 
-int bplus_tree::remove(const key_t& key)
+latch_t *latch_table::acquire(off_t offset, bool exclusive)
 {
-    internal_node_t parent;
-    leaf_node_t leaf;
-
-    // find parent node
-    off_t parent_off = search_index(key);
-    map(&parent, parent_off);
-
-    // find current node
-    index_t *where = find(parent, key);
-    off_t offset = where->child;
-    map(&leaf, offset);
-
-    // verify
-    if (!binary_search(begin(leaf), end(leaf), key))
-        return -1;
-
-    size_t min_n = meta.leaf_node_num == 1 ? 0 : meta.order / 2;
-    assert(leaf.n >= min_n && leaf.n <= meta.order);
-
-    // delete the key
-    record_t *to_delete = find(leaf, key);
-    std::copy(to_delete + 1, end(leaf), to_delete);
-    leaf.n--;
-
-    // merge or borrow
-    if (leaf.n < min_n) {
-        // first borrow from left
-        bool borrowed = false;
-        if (leaf.prev != 0)
-            borrowed = borrow_key(false, leaf);
-
-        // then borrow from right
-        if (!borrowed && leaf.next != 0)
-            borrowed = borrow_key(true, leaf);
-
-        // finally we merge
-        if (!borrowed) {
-            assert(leaf.next != 0 || leaf.prev != 0);
-
-            key_t index_key;
-
-            if (where == end(parent) - 1) {
-                // if leaf is last element then merge | prev | leaf |
-                assert(leaf.prev != 0);
-                leaf_node_t prev;
-                map(&prev, leaf.prev);
-                index_key = begin(prev)->key;
-
-                merge_leafs(&prev, &leaf);
-                node_remove(&prev, &leaf);
-                unmap(&prev, leaf.prev);
-            } else {
-                // else merge | leaf | next |
-                assert(leaf.next != 0);
-                leaf_node_t next;
-                map(&next, leaf.next);
-                index_key = begin(leaf)->key;
-
-                merge_leafs(&leaf, &next);
-                node_remove(&leaf, &next);
-                unmap(&leaf, offset);
-            }
-
-            // remove parent's key
-            remove_from_index(parent_off, parent, index_key);
+    shard_t &s = shard(offset);
+    pthread_mutex_lock(&s.mutex);
+    latch_t *&latch = s.table[offset];
+    if (latch == NULL) {
+        if (s.spare.empty()) {
+            latch = new latch_t;
+            pthread_rwlock_init(&latch->lock, NULL);
         } else {
-            unmap(&leaf, offset);
+            latch = s.spare.back();
+            s.spare.pop_back();
         }
-    } else {
-        unmap(&leaf, offset);
+        latch->offset = offset;
+        latch->ref = 0;
     }
+    // counted before waiting so the latch stays in the table
+    ++latch->ref;
+    latch_t *l = latch;
+    pthread_mutex_unlock(&s.mutex);
 
-    return 0;
+    if (exclusive)
+        pthread_rwlock_wrlock(&l->lock);
+    else
+        pthread_rwlock_rdlock(&l->lock);
+    return l;
 }
 
-int bplus_tree::insert(const key_t& key, value_t value)
+void latch_table::release(latch_t *latch)
 {
-    off_t parent = search_index(key);
-    off_t offset = search_leaf(parent, key);
-    leaf_node_t leaf;
-    map(&leaf, offset);
+    pthread_rwlock_unlock(&latch->lock);
 
-    // check if we have the same key
-    if (binary_search(begin(leaf), end(leaf), key))
-        return 1;
+    shard_t &s = shard(latch->offset);
+    pthread_mutex_lock(&s.mutex);
+    if (--latch->ref == 0) {
+        s.table.erase(latch->offset);
+        s.spare.push_back(latch);
+    }
+    pthread_mutex_unlock(&s.mutex);
+}
 
-    if (leaf.n == meta.order) {
-        // split when full
+/* FNV-1a of log entries and commits */
+unsigned checksum(const char *data, size_t size)
+{
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ (unsigned char)data[i]) * 16777619u;
+    return h;
+}
 
-        // new sibling leaf
-        leaf_node_t new_leaf;
-        node_create(offset, &leaf, &new_leaf);
+/* kinds of log entries */
+#define LOG_WRITE 1
+#define LOG_MARK 2 /* nothing was half written at this point */
 
-        // find even split point
-        size_t point = leaf.n / 2;
-        bool place_right = keycmp(key, leaf.children[point].key) > 0;
-        if (place_right)
-            ++point;
+write_ahead_log::write_ahead_log()
+    : fd(-1), written(0), durable(0), marked(0), active(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_mutex_init(&sync_mutex, NULL);
+}
 
-        // split
-        std::copy(leaf.children + point, leaf.children + leaf.n,
-                  new_leaf.children);
-        new_leaf.n = leaf.n - point;
-        leaf.n = point;
+write_ahead_log::~write_ahead_log()
+{
+    close();
+    pthread_mutex_destroy(&mutex);
+    pthread_mutex_destroy(&sync_mutex);
+}
 
-        // which part do we put the key
-        if (place_right)
-            insert_record_no_split(&new_leaf, key, value);
-        else
-            insert_record_no_split(&leaf, key, value);
-
-        // save leafs
-        unmap(&leaf, offset);
-        unmap(&new_leaf, leaf.next);
-
-        // insert new index key
-        insert_key_to_index(parent, new_leaf.children[0].key,
-                            offset, leaf.next);
-    } else {
-        insert_record_no_split(&leaf, key, value);
-        unmap(&leaf, offset);
-    }
+int write_ahead_log::open(const char *path)
+{
+    fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        return -1;
 
+    struct stat st;
+    fstat(fd, &st);
+    written = durable = marked = st.st_size;
     return 0;
 }
 
-int bplus_tree::update(const key_t& key, value_t value)
+void write_ahead_log::close()
 {
-    off_t offset = search_leaf(key);
-    leaf_node_t leaf;
-    map(&leaf, offset);
-
-    record_t *record = find(leaf, key);
-    if (record != leaf.children + leaf.n)
-        if (keycmp(key, record->key) == 0) {
-            record->value = value;
-            unmap(&leaf, offset);
-
-            return 0;
-        } else {
-            return 1;
-        }
-    else
-        return -1;
+    if (fd != -1)
+        ::close(fd);
+    fd = -1;
 }
 
-void bplus_tree::remove_from_index(off_t offset, internal_node_t &node,
-                                   const key_t &key)
+void write_ahead_log::begin()
 {
-    size_t min_n = meta.root_offset == offset ? 1 : meta.order / 2;
-    assert(node.n >= min_n && node.n <= meta.order);
-
-    // remove key
-    key_t index_key = begin(node)->key;
-    index_t *to_delete = find(node, key);
-    if (to_delete != end(node)) {
-        (to_delete + 1)->child = to_delete->child;
-        std::copy(to_delete + 1, end(node), to_delete);
-    }
-    node.n--;
-
-    // remove to only one key
-    if (node.n == 1 && meta.root_offset == offset &&
-                       meta.internal_node_num != 1)
-    {
-        unalloc(&node, meta.root_offset);
-        meta.height--;
-        meta.root_offset = node.children[0].child;
-        unmap(&meta, OFFSET_META);
+    if (fd == -1)
         return;
-    }
-
-    // merge or borrow
-    if (node.n < min_n) {
-        internal_node_t parent;
-        map(&parent, node.parent);
-
-        // first borrow from left
-        bool borrowed = false;
-        if (offset != begin(parent)->child)
-            borrowed = borrow_key(false, node, offset);
-
-        // then borrow from right
-        if (!borrowed && offset != (end(parent) - 1)->child)
-            borrowed = borrow_key(true, node, offset);
-
-        // finally we merge
-        if (!borrowed) {
-            assert(node.next != 0 || node.prev != 0);
-
-            if (offset == (end(parent) - 1)->child) {
-                // if leaf is last element then merge | prev | leaf |
-                assert(node.prev != 0);
-                internal_node_t prev;
-                map(&prev, node.prev);
-
-                // merge
-                index_t *where = find(parent, begin(prev)->key);
-                reset_index_children_parent(begin(node), end(node), node.prev);
-                merge_keys(where, prev, node, true);
-                unmap(&prev, node.prev);
-            } else {
-                // else merge | leaf | next |
-                assert(node.next != 0);
-                internal_node_t next;
-                map(&next, node.next);
-
-                // merge
-                index_t *where = find(parent, index_key);
-                reset_index_children_parent(begin(next), end(next), offset);
-                merge_keys(where, node, next);
-                unmap(&node, offset);
-            }
 
-            // remove parent's key
-            remove_from_index(node.parent, parent, index_key);
-        } else {
-            unmap(&node, offset);
-        }
-    } else {
-        unmap(&node, offset);
-    }
+    pthread_mutex_lock(&mutex);
+    ++active;
+    pthread_mutex_unlock(&mutex);
 }
 
-bool bplus_tree::borrow_key(bool from_right, internal_node_t &borrower,
-                            off_t offset)
+void write_ahead_log::end()
 {
-    typedef typename internal_node_t::child_t child_t;
-
-    off_t lender_off = from_right ? borrower.next : borrower.prev;
-    internal_node_t lender;
-    map(&lender, lender_off);
-
-    assert(lender.n >= meta.order / 2);
-    if (lender.n != meta.order / 2) {
-        child_t where_to_lend, where_to_put;
+    if (fd == -1)
+        return;
 
-        internal_node_t parent;
+    pthread_mutex_lock(&mutex);
+    if (--active == 0)
+        push_mark();
+    pthread_mutex_unlock(&mutex);
+}
 
-        // swap keys, draw on paper to see why
-        if (from_right) {
-            where_to_lend = begin(lender);
-            where_to_put = end(borrower);
+void write_ahead_log::mark()
+{
+    if (fd == -1)
+        return;
 
-            map(&parent, borrower.parent);
-            child_t where = lower_bound(begin(parent), end(parent) - 1,
-                                        (end(borrower) -1)->key);
-            where->key = where_to_lend->key;
-            unmap(&parent, borrower.parent);
-        } else {
-            where_to_lend = end(lender) - 1;
-            where_to_put = begin(borrower);
-
-            map(&parent, lender.parent);
-            child_t where = find(parent, begin(lender)->key);
-            // where_to_put->key = where->key;  // We shouldn't change where_to_put->key, because it just records the largest info but we only changes a new one which have been the smallest one
-            where->key = (where_to_lend - 1)->key;
-            unmap(&parent, lender.parent);
-        }
+    pthread_mutex_lock(&mutex);
+    push_mark();
+    pthread_mutex_unlock(&mutex);
+}
 
-        // store
-        std::copy_backward(where_to_put, end(borrower), end(borrower) + 1);
-        *where_to_put = *where_to_lend;
-        borrower.n++;
-
-        // erase
-        reset_index_children_parent(where_to_lend, where_to_lend + 1, offset);
-        std::copy(where_to_lend + 1, end(lender), where_to_lend);
-        lender.n--;
-        unmap(&lender, lender_off);
-        return true;
+void write_ahead_log::push_mark()
+{
+    if (written + buffer.size() > marked) {
+        push(LOG_MARK, 0, 0, NULL, NULL);
+        marked = written + buffer.size();
     }
-
-    return false;
 }
 
-bool bplus_tree::borrow_key(bool from_right, leaf_node_t &borrower)
+size_t write_ahead_log::append(off_t offset, size_t size, const void *before,
+                               const void *after)
 {
-    off_t lender_off = from_right ? borrower.next : borrower.prev;
-    leaf_node_t lender;
-    map(&lender, lender_off);
-
-    assert(lender.n >= meta.order / 2);
-    if (lender.n != meta.order / 2) {
-        typename leaf_node_t::child_t where_to_lend, where_to_put;
+    pthread_mutex_lock(&mutex);
+    push(LOG_WRITE, offset, size, before, after);
+    size_t lsn = written + buffer.size();
+    pthread_mutex_unlock(&mutex);
+    return lsn;
+}
 
-        // decide offset and update parent's index key
-        if (from_right) {
-            where_to_lend = begin(lender);
-            where_to_put = end(borrower);
-            change_parent_child(borrower.parent, begin(borrower)->key,
-                                lender.children[1].key);
-        } else {
-            where_to_lend = end(lender) - 1;
-            where_to_put = begin(borrower);
-            change_parent_child(lender.parent, begin(lender)->key,
-                                where_to_lend->key);
-        }
+void write_ahead_log::push(unsigned type, off_t offset, size_t size,
+                           const void *before, const void *after)
+{
+    entry_t entry;
+    entry.checksum = 0;
+    entry.type = type;
+    entry.offset = offset;
+    entry.size = size;
+
+    size_t at = buffer.size();
+    buffer.resize(at + sizeof(entry) + size * 2);
+    char *p = &buffer[at];
+    memcpy(p, &entry, sizeof(entry));
+    if (size > 0) {
+        memcpy(p + sizeof(entry), before, size);
+        memcpy(p + sizeof(entry) + size, after, size);
+    }
 
-        // store
-        std::copy_backward(where_to_put, end(borrower), end(borrower) + 1);
-        *where_to_put = *where_to_lend;
-        borrower.n++;
+    entry.checksum = checksum(p + sizeof(unsigned),
+                              buffer.size() - at - sizeof(unsigned));
+    memcpy(p, &entry.checksum, sizeof(unsigned));
+}
 
-        // erase
-        std::copy(where_to_lend + 1, end(lender), where_to_lend);
-        lender.n--;
-        unmap(&lender, lender_off);
-        return true;
+int write_ahead_log::sync(size_t lsn)
+{
+    pthread_mutex_lock(&sync_mutex);
+    pthread_mutex_lock(&mutex);
+    size_t end = std::min(lsn, written + buffer.size());
+    if (durable >= end) {
+        pthread_mutex_unlock(&mutex);
+        pthread_mutex_unlock(&sync_mutex);
+        return 0;
     }
 
-    return false;
+    // others keep appending while this group goes to disk
+    std::vector<char> group;
+    group.swap(buffer);
+    size_t at = written;
+    written += group.size();
+    pthread_mutex_unlock(&mutex);
+
+    int ret = 0;
+    if (!group.empty() &&
+        pwrite(fd, &group[0], group.size(), at) != (ssize_t)group.size())
+        ret = -1;
+    if (ret == 0 && fdatasync(fd) != 0)
+        ret = -1;
+
+    if (ret == 0) {
+        pthread_mutex_lock(&mutex);
+        durable = at + group.size();
+        pthread_mutex_unlock(&mutex);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+    return ret;
 }
 
-void bplus_tree::change_parent_child(off_t parent, const key_t &o,
-                                     const key_t &n)
+size_t write_ahead_log::size() const
 {
-    internal_node_t node;
-    map(&node, parent);
+    pthread_mutex_lock(&mutex);
+    size_t size = written + buffer.size();
+    pthread_mutex_unlock(&mutex);
+    return size;
+}
 
-    index_t *w = find(node, o);
-    assert(w != node.children + node.n); 
+int write_ahead_log::recover(int db)
+{
+    struct stat st;
+    fstat(fd, &st);
+    std::vector<char> log(st.st_size);
+    if (log.size() > 0 && pread(fd, &log[0], log.size(), 0) != st.st_size)
+        return -1;
 
-    w->key = n;
-    unmap(&node, parent);
-    if (w == node.children + node.n - 1) {
-        change_parent_child(node.parent, o, n);
+    // a torn or garbled entry ends the log
+    std::vector<size_t> writes;
+    size_t consistent = 0; /* writes before the last mark */
+    size_t pos = 0;
+    while (pos + sizeof(entry_t) <= log.size()) {
+        entry_t entry;
+        memcpy(&entry, &log[pos], sizeof(entry));
+        if (entry.size > log.size())
+            break;
+        size_t len = sizeof(entry) + entry.size * 2;
+        if (pos + len > log.size() ||
+            checksum(&log[pos] + sizeof(unsigned), len - sizeof(unsigned))
+                != entry.checksum)
+            break;
+
+        if (entry.type == LOG_MARK)
+            consistent = writes.size();
+        else if (entry.type == LOG_WRITE)
+            writes.push_back(pos);
+        else
+            break;
+        pos += len;
     }
+
+    // redo up to the mark, then undo newest first after it
+    int ret = 0;
+    for (size_t i = 0; i < consistent; i++)
+        if (restore(db, &log[writes[i]], true) != 0)
+            ret = -1;
+    for (size_t i = writes.size(); i > consistent; i--)
+        if (restore(db, &log[writes[i - 1]], false) != 0)
+            ret = -1;
+    if (!writes.empty() && fsync(db) != 0)
+        ret = -1;
+
+    if (ret == 0)
+        reset();
+    return ret;
 }
 
-void bplus_tree::merge_leafs(leaf_node_t *left, leaf_node_t *right)
+int write_ahead_log::restore(int db, const char *data, bool after)
 {
-    std::copy(begin(*right), end(*right), end(*left));
-    left->n += right->n;
+    entry_t entry;
+    memcpy(&entry, data, sizeof(entry));
+    const char *block = data + sizeof(entry) + (after ? entry.size : 0);
+    ssize_t wd = pwrite(db, block, entry.size, entry.offset);
+    return wd == (ssize_t)entry.size ? 0 : -1;
 }
 
-void bplus_tree::merge_keys(index_t *where,
-                            internal_node_t &node, internal_node_t &next, bool change_where_key)
+void write_ahead_log::reset()
 {
-    //(end(node) - 1)->key = where->key;
-    if (change_where_key) {
-        where->key = (end(next) - 1)->key;
-    }
-    std::copy(begin(next), end(next), end(node));
-    node.n += next.n;
-    node_remove(&node, &next);
+    // a group on its way to the file would land after the truncation
+    pthread_mutex_lock(&sync_mutex);
+    pthread_mutex_lock(&mutex);
+    buffer.clear();
+    ftruncate(fd, 0);
+    fsync(fd);
+    written = durable = marked = 0;
+    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&sync_mutex);
 }
 
-void bplus_tree::insert_record_no_split(leaf_node_t *leaf,
-                                        const key_t &key, const value_t &value)
+void shadow_map::reset()
 {
-    record_t *where = upper_bound(begin(*leaf), end(*leaf), key);
-    std::copy_backward(where, end(*leaf), end(*leaf) + 1);
-
-    where->key = key;
-    where->value = value;
-    leaf->n++;
+    end = start;
+    slots.clear();
+    moved.clear();
+    table.clear();
+    dirty.clear();
+    spare.clear();
+    released.clear();
 }
 
-void bplus_tree::insert_key_to_index(off_t offset, const key_t &key,
-                                     off_t old, off_t after)
+int shadow_map::load(int fd, const commit_t &commit)
 {
-    if (offset == 0) {
-        // create new root node
-        internal_node_t root;
-        root.next = root.prev = root.parent = 0;
-        meta.root_offset = alloc(&root);
-        meta.height++;
+    reset();
+    end = commit.end;
+    slots.resize(commit.blocks, 0);
+    moved.resize(commit.blocks, 0);
+    if (commit.blocks == 0)
+        return commit.table_height == 0 ? 0 : -1;
+
+    // pages on every level, the top one has a single page
+    std::vector<size_t> counts;
+    size_t n = commit.blocks;
+    do {
+        n = (n + fanout - 1) / fanout;
+        counts.push_back(n);
+    } while (n > 1);
+    if (counts.size() != commit.table_height)
+        return -1;
 
-        // insert `old` and `after`
-        root.n = 2;
-        root.children[0].key = key;
-        root.children[0].child = old;
-        root.children[1].child = after;
+    table.resize(counts.size());
+    table.back().push_back(commit.table_root);
+    for (size_t level = counts.size(); level-- > 0;) {
+        std::vector<off_t> &below = level == 0 ? slots : table[level - 1];
+        size_t total = level == 0 ? commit.blocks : counts[level - 1];
+        below.resize(total, 0);
+        for (size_t p = 0; p < table[level].size(); p++) {
+            std::vector<off_t> page(fanout);
+            ssize_t size = fanout * sizeof(off_t);
+            if (pread(fd, &page[0], size, table[level][p]) != size)
+                return -1;
+            for (size_t i = 0; i < fanout; i++)
+                if (p * fanout + i < total)
+                    below[p * fanout + i] = page[i];
+        }
+    }
 
-        unmap(&meta, OFFSET_META);
-        unmap(&root, meta.root_offset);
+    // every slot nothing points to can be used again
+    std::vector<char> used((end - start) / block_size, 0);
+    for (size_t i = 0; i < slots.size(); i++)
+        if (slots[i] != 0)
+            used[(slots[i] - start) / block_size] = 1;
+    for (size_t level = 0; level < table.size(); level++)
+        for (size_t p = 0; p < table[level].size(); p++)
+            used[(table[level][p] - start) / block_size] = 1;
+    for (size_t i = 0; i < used.size(); i++)
+        if (!used[i])
+            spare.insert(start + i * block_size);
+    return 0;
+}
 
-        // update children's parent
-        reset_index_children_parent(begin(root), end(root),
-                                    meta.root_offset);
-        return;
+int shadow_map::save(int fd, commit_t *commit)
+{
+    commit->blocks = slots.size();
+    if (slots.empty()) {
+        commit->table_root = 0;
+        commit->table_height = 0;
+        commit->end = end;
+        return 0;
     }
 
-    internal_node_t node;
-    map(&node, offset);
-    assert(node.n <= meta.order);
+    std::vector<size_t> counts;
+    size_t n = slots.size();
+    do {
+        n = (n + fanout - 1) / fanout;
+        counts.push_back(n);
+    } while (n > 1);
+    table.resize(counts.size());
+
+    // a changed page changes the slot its parent page holds for it, the
+    // pages above are found again from the lowest ones on a retry
+    std::set<size_t> pages = dirty;
+    for (size_t level = 0; level < counts.size(); level++) {
+        const std::vector<off_t> &below = level == 0 ? slots
+                                                     : table[level - 1];
+        table[level].resize(counts[level], 0);
+        std::set<size_t> up;
+        for (std::set<size_t>::iterator p = pages.begin(); p != pages.end();
+             ++p) {
+            std::vector<off_t> page(fanout);
+            for (size_t i = 0; i < fanout; i++) {
+                size_t k = *p * fanout + i;
+                page[i] = k < below.size() ? below[k] : 0;
+            }
 
-    if (node.n == meta.order) {
-        // split when full
+            if (table[level][*p] != 0)
+                released.push_back(table[level][*p]);
+            table[level][*p] = take();
+            ssize_t size = fanout * sizeof(off_t);
+            if (pwrite(fd, &page[0], size, table[level][*p]) != size)
+                return -1;
+            up.insert(*p / fanout);
+        }
+        pages.swap(up);
+    }
 
-        internal_node_t new_node;
-        node_create(offset, &node, &new_node);
+    dirty.clear();
+    commit->table_root = table.back()[0];
+    commit->table_height = table.size();
+    commit->end = end;
+    return 0;
+}
 
-        // find even split point
-        size_t point = (node.n - 1) / 2;
-        bool place_right = keycmp(key, node.children[point].key) > 0;
-        if (place_right)
-            ++point;
+void shadow_map::committed()
+{
+    spare.insert(released.begin(), released.end());
+    released.clear();
+    std::fill(moved.begin(), moved.end(), 0);
+}
 
-        // prevent the `key` being the right `middle_key`
-        // example: insert 48 into |42|45| 6|  |
-        if (place_right && keycmp(key, node.children[point].key) < 0)
-            point--;
+off_t shadow_map::relocate(size_t i, off_t *old)
+{
+    if (i >= slots.size()) {
+        slots.resize(i + 1, 0);
+        moved.resize(i + 1, 0);
+    }
 
-        key_t middle_key = node.children[point].key;
+    *old = 0;
+    if (!moved[i]) {
+        // the last commit still needs the block where it is
+        *old = slots[i];
+        if (*old != 0)
+            released.push_back(*old);
+        slots[i] = take();
+        moved[i] = 1;
+        dirty.insert(i / fanout);
+    }
+    return slots[i];
+}
 
-        // split
-        std::copy(begin(node) + point + 1, end(node), begin(new_node));
-        new_node.n = node.n - point - 1;
-        node.n = point + 1;
+off_t shadow_map::take()
+{
+    if (!spare.empty()) {
+        off_t slot = *spare.begin();
+        spare.erase(spare.begin());
+        return slot;
+    }
 
-        // put the new key
-        if (place_right)
-            insert_key_to_index_no_split(new_node, key, after);
-        else
-            insert_key_to_index_no_split(node, key, after);
+    off_t slot = end;
+    end += block_size;
+    return slot;
+}
 
-        unmap(&node, offset);
-        unmap(&new_node, node.next);
+/* how many keys of a window pass, one at a time */
+static size_t count_scalar(const char *keys, size_t stride, size_t n,
+                           const key_t &key, bool inclusive)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        int x = keycmp(*(const key_t *)(keys + i * stride), key);
+        count += inclusive ? x <= 0 : x < 0;
+    }
+    return count;
+}
 
-        // update children's parent
-        reset_index_children_parent(begin(new_node), end(new_node), node.next);
+#ifdef __SSE2__
+/* `lt` and `gt` mark the bytes of a key below and above those of the
+ * searched one, the first byte that differs decides */
+static inline size_t passes(unsigned lt, unsigned gt, bool inclusive)
+{
+    unsigned first = (lt | gt) & -(lt | gt);
+    return inclusive ? (first & gt) == 0 : (first & lt) != 0;
+}
 
-        // give the middle key to the parent
-        // note: middle key's child is reserved
-        insert_key_to_index(node.parent, middle_key, offset, node.next);
-    } else {
-        insert_key_to_index_no_split(node, key, after);
-        unmap(&node, offset);
+/* bytes compare as unsigned once their top bit is flipped */
+static size_t count_sse2(const char *keys, size_t stride, size_t n,
+                         const key_t &key, bool inclusive)
+{
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i t = _mm_xor_si128(_mm_loadu_si128((const __m128i *)key.k), bias);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        __m128i k = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)(keys + i * stride)), bias);
+        unsigned lt = _mm_movemask_epi8(_mm_cmpgt_epi8(t, k));
+        unsigned gt = _mm_movemask_epi8(_mm_cmpgt_epi8(k, t));
+        count += passes(lt, gt, inclusive);
     }
+    return count;
 }
 
-void bplus_tree::insert_key_to_index_no_split(internal_node_t &node,
-                                              const key_t &key, off_t value)
+/* two keys at a time */
+__attribute__((target("avx2")))
+static size_t count_avx2(const char *keys, size_t stride, size_t n,
+                         const key_t &key, bool inclusive)
 {
-    index_t *where = upper_bound(begin(node), end(node) - 1, key);
+    const __m256i bias = _mm256_set1_epi8((char)0x80);
+    __m256i t = _mm256_xor_si256(_mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)key.k)), bias);
+    size_t count = 0, i = 0;
+    for (; i + 2 <= n; i += 2) {
+        const char *at = keys + i * stride;
+        __m256i k = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i *)at)),
+            _mm_loadu_si128((const __m128i *)(at + stride)), 1);
+        k = _mm256_xor_si256(k, bias);
+        unsigned lt = _mm256_movemask_epi8(_mm256_cmpgt_epi8(t, k));
+        unsigned gt = _mm256_movemask_epi8(_mm256_cmpgt_epi8(k, t));
+        count += passes(lt & 0xffff, gt & 0xffff, inclusive) +
+                 passes(lt >> 16, gt >> 16, inclusive);
+    }
+    if (i < n) {
+        // the odd one out, with the VEX form of the SSE2 kernel
+        __m128i k = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)(keys + i * stride)),
+            _mm256_castsi256_si128(bias));
+        __m128i t1 = _mm256_castsi256_si128(t);
+        unsigned lt = _mm_movemask_epi8(_mm_cmpgt_epi8(t1, k));
+        unsigned gt = _mm_movemask_epi8(_mm_cmpgt_epi8(k, t1));
+        count += passes(lt, gt, inclusive);
+    }
+    return count;
+}
+#endif
 
-    // move later index forward
-    std::copy_backward(where, end(node), end(node) + 1);
+/* kernels by BP_SCALAR, BP_SSE2 and BP_AVX2, NULL if not built */
+typedef size_t (*count_t)(const char *keys, size_t stride, size_t n,
+                          const key_t &key, bool inclusive);
+#ifdef __SSE2__
+static const count_t kernels[] = { count_scalar, count_sse2, count_avx2 };
+#else
+static const count_t kernels[] = { count_scalar, NULL, NULL };
+#endif
 
-    // insert this key
-    where->key = key;
-    where->child = (where + 1)->child;
-    (where + 1)->child = value;
+/* chosen on first use, -1 before */
+static int kernel = -1;
 
-    node.n++;
-}
+/* keys left to the kernel once binary search narrows the range */
+static const size_t window = 8;
 
-void bplus_tree::reset_index_children_parent(index_t *begin, index_t *end,
-                                             off_t parent)
+static bool has_kernel(int k)
 {
-    // this function can change both internal_node_t and leaf_node_t's parent
-    // field, but we should ensure that:
-    // 1. sizeof(internal_node_t) <= sizeof(leaf_node_t)
-    // 2. parent field is placed in the beginning and have same size
-    internal_node_t node;
-    while (begin != end) {
-        map(&node, begin->child);
-        node.parent = parent;
-        unmap(&node, begin->child, SIZE_NO_CHILDREN);
-        ++begin;
+    if (k < BP_SCALAR || k > BP_AVX2 || kernels[k] == NULL)
+        return false;
+#ifdef __SSE2__
+    if (k == BP_AVX2) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
     }
+#endif
+    return true;
 }
 
-off_t bplus_tree::search_index(const key_t &key) const
+int key_kernel()
 {
-    off_t org = meta.root_offset;
-    int height = meta.height;
-    while (height > 1) {
-        internal_node_t node;
-        map(&node, org);
-
-        index_t *i = upper_bound(begin(node), end(node) - 1, key);
-        org = i->child;
-        --height;
+    int k = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if (k == -1) {
+        k = BP_AVX2;
+        while (!has_kernel(k))
+            --k;
+        __atomic_store_n(&kernel, k, __ATOMIC_RELAXED);
     }
-
-    return org;
+    return k;
 }
 
-off_t bplus_tree::search_leaf(off_t index, const key_t &key) const
+int set_key_kernel(int k)
 {
-    internal_node_t node;
-    map(&node, index);
-
-    index_t *i = upper_bound(begin(node), end(node) - 1, key);
-    return i->child;
+    if (!has_kernel(k))
+        return -1;
+    __atomic_store_n(&kernel, k, __ATOMIC_RELAXED);
+    return 0;
 }
 
-template<class T>
-void bplus_tree::node_create(off_t offset, T *node, T *next)
+size_t key_rank(const key_t *keys, size_t stride, size_t n,
+                const key_t &key, bool inclusive)
 {
-    // new sibling node
-    next->parent = node->parent;
-    next->next = node->next;
-    next->prev = offset;
-    node->next = alloc(next);
-    // update next node's prev
-    if (next->next != 0) {
-        T old_next;
-        map(&old_next, next->next, SIZE_NO_CHILDREN);
-        old_next.prev = node->next;
-        unmap(&old_next, next->next, SIZE_NO_CHILDREN);
+    static_assert(sizeof(key_t) == 16, "kernels compare 16 byte keys");
+
+    const char *base = (const char *)keys;
+    size_t first = 0;
+    while (n > window) {
+        size_t half = n / 2;
+        int x = keycmp(*(const key_t *)(base + (first + half) * stride), key);
+        if (inclusive ? x <= 0 : x < 0) {
+            first += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
     }
-    unmap(&meta, OFFSET_META);
+    return first + kernels[key_kernel()](base + first * stride, stride, n,
+                                         key, inclusive);
 }
 
-template<class T>
-void bplus_tree::node_remove(T *prev, T *node)
+options_t &default_options()
 {
-    unalloc(node, prev->next);
-    prev->next = node->next;
-    if (node->next != 0) {
-        T next;
-        map(&next, node->next, SIZE_NO_CHILDREN);
-        next.prev = node->prev;
-        unmap(&next, node->next, SIZE_NO_CHILDREN);
-    }
-    unmap(&meta, OFFSET_META);
-}
-
-void bplus_tree::init_from_empty()
-{
-    // init default meta
-    bzero(&meta, sizeof(meta_t));
-    meta.order = BP_ORDER;
-    meta.value_size = sizeof(value_t);
-    meta.key_size = sizeof(key_t);
-    meta.height = 1;
-    meta.slot = OFFSET_BLOCK;
-
-    // init root node
-    internal_node_t root;
-    root.next = root.prev = root.parent = 0;
-    meta.root_offset = alloc(&root);
-
-    // init empty leaf
-    leaf_node_t leaf;
-    leaf.next = leaf.prev = 0;
-    leaf.parent = meta.root_offset;
-    meta.leaf_offset = root.children[0].child = alloc(&leaf);
-
-    // save
-    unmap(&meta, OFFSET_META);
-    unmap(&root, meta.root_offset);
-    unmap(&leaf, root.children[0].child);
+    static options_t options;
+    return options;
+}
+
+unsigned long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
 }
 
 }
@@ -5,207 +5,2090 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <unordered_map>
 
-#ifndef UNIT_TEST
 #include "predefined.h"
-#else
-#include "util/unit_test_predefined.h"
-#endif
 
-namespace bpt {
+namespace bpt {
+
+/* open flags */
+#define BP_MMAP 0x1 /* map the whole file instead of caching blocks */
+#define BP_THREAD_SAFE 0x2 /* allow concurrent calls from many threads */
+#define BP_WAL 0x4 /* log writes to `path`.wal and sync them in groups */
+#define BP_COW 0x8 /* write blocks to fresh slots, commit by switching meta */
+
+/* kernels comparing the last few default keys of an in-node search */
+#define BP_SCALAR 0
+#define BP_SSE2 1
+#define BP_AVX2 2
+
+/* offsets */
+#define OFFSET_META 0
+
+/* meta information of B+ tree */
+typedef struct {
+    size_t order; /* `order` of B+ tree */
+    size_t value_size; /* size of value */
+    size_t key_size;   /* size of key */
+    size_t page_size;  /* no block straddles pages of this size */
+    size_t internal_node_num; /* how many internal nodes */
+    size_t leaf_node_num;     /* how many leafs */
+    size_t height;            /* height of tree (exclude leafs) */
+    off_t slot;        /* where to store new block */
+    off_t root_offset; /* where is the root of internal nodes */
+    off_t leaf_offset; /* where is the first leaf */
+    off_t free_leaf;     /* first leaf block that can be reused */
+    off_t free_internal; /* first internal block that can be reused */
+} meta_t;
+
+/* in-memory copy of the first `size` bytes of a block */
+struct frame_t {
+    off_t offset;
+    size_t size;
+    int pin;    /* pinned frames are never evicted */
+    bool dirty; /* needs to be written back */
+    size_t lsn; /* log end after the last change, 0 if not logged */
+    frame_t *prev, *next; /* LRU list, most recently used first */
+    char *data; /* room for the largest block */
+};
+
+/* fixed-size block cache with LRU eviction */
+class buffer_pool {
+public:
+    buffer_pool(size_t capacity, size_t block_size);
+    ~buffer_pool();
+
+    /* find cached block and mark it as most recently used */
+    frame_t *find(off_t offset);
+
+    /* least recently used unpinned frame, NULL when all frames are pinned */
+    frame_t *victim() const;
+
+    /* drop every frame without writing it back */
+    void clear();
+
+    /* bind frame to a new block, the old content is dropped */
+    void attach(frame_t *frame, off_t offset);
+    void detach(frame_t *frame);
+
+    void pin(frame_t *frame)
+    {
+        ++frame->pin;
+    }
+
+    void unpin(frame_t *frame, bool dirty)
+    {
+        assert(frame->pin > 0);
+        --frame->pin;
+        frame->dirty = frame->dirty || dirty;
+    }
+
+    size_t capacity;
+    size_t block_size;
+    frame_t *frames;
+
+private:
+    char *blocks; /* data of all frames */
+    frame_t lru; /* sentinel of LRU list */
+    std::unordered_map<off_t, frame_t *> table;
+
+    void lru_remove(frame_t *frame);
+    void lru_push_front(frame_t *frame);
+
+    buffer_pool(const buffer_pool &);
+    buffer_pool &operator=(const buffer_pool &);
+};
+
+/* reader/writer latch of one node, lives while anyone holds or waits */
+struct latch_t {
+    off_t offset;
+    int ref;
+    pthread_rwlock_t lock;
+};
+
+/* latches of nodes by offset, created on demand */
+class latch_table {
+public:
+    latch_table();
+    ~latch_table();
+
+    latch_t *acquire(off_t offset, bool exclusive);
+    void release(latch_t *latch);
+
+private:
+    /* split by offset so threads on different nodes don't meet */
+    struct shard_t {
+        pthread_mutex_t mutex;
+        std::unordered_map<off_t, latch_t *> table;
+        std::vector<latch_t *> spare; /* released latches kept for reuse */
+    };
+    shard_t shards[64];
+
+    shard_t &shard(off_t offset)
+    {
+        return shards[((size_t)offset * 0x9e3779b97f4a7c15ULL) >> 58];
+    }
+
+    latch_table(const latch_table &);
+    latch_table &operator=(const latch_table &);
+};
+
+/* log of block writes kept next to the database file, every record holds
+ * the block before and after the write, so a crash can both redo writes
+ * that never reached the file and undo ones that did too early */
+class write_ahead_log {
+public:
+    write_ahead_log();
+    ~write_ahead_log();
+
+    /* returns -1 if the log file can't be opened */
+    int open(const char *path);
+    void close();
+
+    bool enabled() const
+    {
+        return fd != -1;
+    }
+
+    /* writes between begin() and end() are logged, the file is in a
+     * consistent state whenever no one is in between */
+    void begin();
+    void end();
+
+    bool logging() const
+    {
+        return fd != -1 && __atomic_load_n(&active, __ATOMIC_RELAXED) > 0;
+    }
+
+    /* nothing is half written right now, called with no one in between
+     * or while they are all held off */
+    void mark();
+
+    /* queue a write, returns the log position just past it */
+    size_t append(off_t offset, size_t size, const void *before,
+                  const void *after);
+
+    /* write and fsync the log up to at least `lsn` */
+    int sync(size_t lsn = (size_t)-1);
+
+    /* bytes logged since the last reset */
+    size_t size() const;
+
+    /* redo the writes up to the last consistent point and undo the ones
+     * after it on database file `db`, then empty the log */
+    int recover(int db);
+
+    /* drop everything, the database file has it all */
+    void reset();
+
+private:
+    struct entry_t {
+        unsigned checksum; /* of the rest of the entry */
+        unsigned type;
+        off_t offset;
+        size_t size; /* followed by the block before and after */
+    };
+
+    int fd;
+    mutable pthread_mutex_t mutex;
+    pthread_mutex_t sync_mutex; /* one writer of the file at a time */
+    std::vector<char> buffer; /* appended but not written yet */
+    size_t written; /* where `buffer` goes in the file */
+    size_t durable; /* fsynced up to here */
+    size_t marked; /* end of the last consistent point */
+    int active; /* writers between begin() and end() */
+
+    void push(unsigned type, off_t offset, size_t size, const void *before,
+              const void *after);
+    void push_mark();
+    /* write the block of entry `data` as it was after or before */
+    static int restore(int db, const char *data, bool after);
+
+    write_ahead_log(const write_ahead_log &);
+    write_ahead_log &operator=(const write_ahead_log &);
+};
+
+/* BP_COW: the head of the file holds two of these in turn, the valid one
+ * with the larger `seq` is the tree */
+struct commit_t {
+    unsigned checksum; /* of the rest of the commit */
+    unsigned long seq;
+    meta_t meta;
+    off_t table_root; /* see shadow_map */
+    size_t table_height;
+    size_t blocks;
+    off_t end;
+};
+
+/* where commit pages are, blocks start after both */
+#define COMMIT_PAGE 512
+#define OFFSET_SLOTS (2 * COMMIT_PAGE)
+
+/* BP_COW: slot in the file of every block of the tree, a block moves to a
+ * fresh slot the first time it is written after a commit so the last
+ * commit stays intact, the map is saved as a radix tree of table pages
+ * which are copied on write the same way */
+class shadow_map {
+public:
+    /* every block and table page takes `size` bytes, and slots start at
+     * a multiple of it */
+    shadow_map(size_t size)
+        : end((OFFSET_SLOTS + size - 1) / size * size), start(end),
+          block_size(size), fanout(size / sizeof(off_t)) {}
+
+    /* forget every block */
+    void reset();
+
+    /* read the map saved by save(), returns -1 if it is broken */
+    int load(int fd, const commit_t &commit);
+
+    /* write the table pages that changed, returns -1 and keeps them
+     * changed if one can't be written */
+    int save(int fd, commit_t *commit);
+
+    /* the commit is on disk, slots only the one before used are free */
+    void committed();
+
+    /* slot of block `i`, 0 if it was never written */
+    off_t slot(size_t i) const
+    {
+        return i < slots.size() ? slots[i] : 0;
+    }
+
+    /* slot to write block `i` to, `old` is where the block was if it
+     * has just moved, 0 otherwise */
+    off_t relocate(size_t i, off_t *old);
+
+    bool changed() const
+    {
+        return !dirty.empty();
+    }
+
+    off_t end; /* first slot past everything ever used */
+
+private:
+    off_t start; /* first slot */
+    size_t block_size;
+    size_t fanout; /* slots a table page holds */
+    std::vector<off_t> slots;
+    std::vector<char> moved; /* has a fresh slot since the last commit */
+    std::vector<std::vector<off_t> > table; /* table pages by level */
+    std::set<size_t> dirty; /* table pages of the lowest level to save */
+    std::set<off_t> spare; /* the lowest first, so the file stays dense */
+    std::vector<off_t> released; /* free once the next commit is on disk */
+
+    off_t take();
+
+    shadow_map(const shadow_map &);
+    shadow_map &operator=(const shadow_map &);
+};
+
+/* the tree as it was when a snapshot was taken, blocks written since then
+ * are saved to the spill file first */
+struct snapshot_t {
+    meta_t meta;
+    int ref; /* views sharing it */
+    std::unordered_map<off_t, off_t> blocks; /* where in the spill file */
+    std::unordered_map<off_t, std::vector<char> > held; /* it couldn't */
+};
+
+/* a block written inside a transaction, kept whole so it can be read
+ * back, the first `size` bytes go out on commit */
+struct dirty_block_t {
+    size_t size;
+    std::vector<char> data;
+};
+
+/* FNV-1a of log entries and commits */
+unsigned checksum(const char *data, size_t size);
+
+unsigned long now_ms();
+
+/* how many children of `child` bytes fit in a page after `head` bytes */
+constexpr size_t page_fill(size_t head, size_t child)
+{
+    return head < BP_PAGE_SIZE ? (BP_PAGE_SIZE - head) / child : 0;
+}
+
+/* room for `size` bytes that never straddles a page when blocks are laid
+ * out one after another from a multiple of it, a power of two up to a
+ * page and whole pages beyond */
+constexpr size_t page_block(size_t size, size_t block = 1)
+{
+    return size > BP_PAGE_SIZE
+           ? (size + BP_PAGE_SIZE - 1) / BP_PAGE_SIZE * BP_PAGE_SIZE
+           : block >= size ? block : page_block(size, block * 2);
+}
+
+/* in-node search of default keys, how many of the `n` sorted keys from
+ * `keys` on, `stride` bytes apart, are less than `key`, or not greater if
+ * `inclusive`, binary search narrows the range to a few keys which the
+ * kernel compares at once */
+size_t key_rank(const key_t *keys, size_t stride, size_t n,
+                const key_t &key, bool inclusive);
+
+/* the kernel key_rank() uses, the best one the CPU has unless set, setting
+ * one the CPU or build lacks returns -1 */
+int key_kernel();
+int set_key_kernel(int kernel);
+
+/* iterator over the children of a node in column layout, `Ref` binds a
+ * key and its child or value the way `Element` holds them in a row */
+template<class Element, class Ref, class Key, class Second>
+class column_iterator {
+public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef Element value_type;
+    typedef ptrdiff_t difference_type;
+    typedef Ref reference;
+
+    /* `it->key` goes through this */
+    struct pointer {
+        Ref ref;
+
+        Ref *operator->()
+        {
+            return &ref;
+        }
+    };
+
+    column_iterator() : keys(NULL), seconds(NULL) {}
+    column_iterator(Key *k, Second *s) : keys(k), seconds(s) {}
+
+    Ref operator*() const
+    {
+        return Ref(*keys, *seconds);
+    }
+
+    pointer operator->() const
+    {
+        pointer p = { **this };
+        return p;
+    }
+
+    Ref operator[](ptrdiff_t i) const
+    {
+        return Ref(keys[i], seconds[i]);
+    }
+
+    column_iterator &operator++()
+    {
+        ++keys;
+        ++seconds;
+        return *this;
+    }
+
+    column_iterator &operator--()
+    {
+        --keys;
+        --seconds;
+        return *this;
+    }
+
+    column_iterator operator++(int)
+    {
+        column_iterator i = *this;
+        ++*this;
+        return i;
+    }
+
+    column_iterator operator--(int)
+    {
+        column_iterator i = *this;
+        --*this;
+        return i;
+    }
+
+    column_iterator &operator+=(ptrdiff_t n)
+    {
+        keys += n;
+        seconds += n;
+        return *this;
+    }
+
+    column_iterator &operator-=(ptrdiff_t n)
+    {
+        return *this += -n;
+    }
+
+    column_iterator operator+(ptrdiff_t n) const
+    {
+        return column_iterator(keys + n, seconds + n);
+    }
+
+    column_iterator operator-(ptrdiff_t n) const
+    {
+        return column_iterator(keys - n, seconds - n);
+    }
+
+    ptrdiff_t operator-(const column_iterator &i) const
+    {
+        return keys - i.keys;
+    }
+
+    bool operator==(const column_iterator &i) const
+    {
+        return keys == i.keys;
+    }
+
+    bool operator!=(const column_iterator &i) const
+    {
+        return keys != i.keys;
+    }
+
+    bool operator<(const column_iterator &i) const
+    {
+        return keys < i.keys;
+    }
+
+    bool operator>(const column_iterator &i) const
+    {
+        return keys > i.keys;
+    }
+
+    bool operator<=(const column_iterator &i) const
+    {
+        return keys <= i.keys;
+    }
+
+    bool operator>=(const column_iterator &i) const
+    {
+        return keys >= i.keys;
+    }
+
+    Key *keys;
+    Second *seconds;
+};
+
+/* children of a node in column layout, all keys first, then all children
+ * or values */
+template<class Element, class Ref, class Key, class Second, size_t N>
+struct column_array {
+    typedef column_iterator<Element, Ref, Key, Second> iterator;
+
+    Key keys[N];
+    Second seconds[N];
+
+    operator iterator()
+    {
+        return iterator(keys, seconds);
+    }
+
+    iterator operator+(size_t i)
+    {
+        return iterator(keys + i, seconds + i);
+    }
+
+    Ref operator[](size_t i)
+    {
+        return Ref(keys[i], seconds[i]);
+    }
+
+    /* the reference types have no const form, nodes are only read
+     * through a const one */
+    Ref operator[](size_t i) const
+    {
+        return Ref(const_cast<Key &>(keys[i]),
+                   const_cast<Second &>(seconds[i]));
+    }
+};
+
+/* how the leaves of a layout make room, the ones of row_nodes and
+ * column_nodes always hold `N` children whatever their keys */
+template<size_t N>
+struct fixed_room {
+    /* how many children the leaf holds as it is laid out now */
+    template<class Array>
+    static size_t capacity(const Array &)
+    {
+        return N;
+    }
+
+    /* lay the leaf out so that `key` fits after its `n` children, false if
+     * it is full */
+    template<class Array, class Key>
+    static bool make_room(Array &, size_t n, const Key &)
+    {
+        return n < N;
+    }
+
+    /* lay the leaf out for the records from `first` to `last`, which are
+     * written next, returns how many fit */
+    template<class Array, class It>
+    static size_t reshape(Array &, It, It)
+    {
+        return N;
+    }
+
+    /* lay the node out so that `key` can replace one of its `n` children's
+     * keys, false if it can't */
+    template<class Array, class Key>
+    static bool take_key(Array &, size_t, const Key &)
+    {
+        return true;
+    }
+
+    /* take less room if the `n` children allow, or any key again */
+    template<class Array>
+    static void pack(Array &, size_t) {}
+    template<class Array>
+    static void unpack(Array &, size_t) {}
+
+    /* lay a new node out for no children */
+    template<class Array>
+    static void clear(Array &) {}
+};
+
+/* a key of a prefix_array, reading and assigning it goes through it */
+template<class Array>
+class prefix_key {
+public:
+    prefix_key(Array *a, size_t i) : array(a), at(i) {}
+
+    operator key_t() const
+    {
+        return array->key(at);
+    }
+
+    prefix_key &operator=(const key_t &key)
+    {
+        array->set_key(at, key);
+        return *this;
+    }
+
+    prefix_key &operator=(const prefix_key &key)
+    {
+        return *this = key_t(key);
+    }
+
+private:
+    Array *array;
+    size_t at;
+};
+
+/* iterator over the children of a prefix_array */
+template<class Array, class Element, class Ref>
+class prefix_iterator {
+public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef Element value_type;
+    typedef ptrdiff_t difference_type;
+    typedef Ref reference;
+
+    /* `it->key` goes through this */
+    struct pointer {
+        Ref ref;
+
+        Ref *operator->()
+        {
+            return &ref;
+        }
+    };
+
+    prefix_iterator() : array(NULL), at(0) {}
+    prefix_iterator(Array *a, ptrdiff_t i) : array(a), at(i) {}
+
+    Ref operator*() const
+    {
+        return (*array)[at];
+    }
+
+    pointer operator->() const
+    {
+        pointer p = { **this };
+        return p;
+    }
+
+    Ref operator[](ptrdiff_t i) const
+    {
+        return (*array)[at + i];
+    }
+
+    prefix_iterator &operator++()
+    {
+        ++at;
+        return *this;
+    }
+
+    prefix_iterator &operator--()
+    {
+        --at;
+        return *this;
+    }
+
+    prefix_iterator operator++(int)
+    {
+        prefix_iterator i = *this;
+        ++at;
+        return i;
+    }
+
+    prefix_iterator operator--(int)
+    {
+        prefix_iterator i = *this;
+        --at;
+        return i;
+    }
+
+    prefix_iterator &operator+=(ptrdiff_t n)
+    {
+        at += n;
+        return *this;
+    }
+
+    prefix_iterator &operator-=(ptrdiff_t n)
+    {
+        at -= n;
+        return *this;
+    }
+
+    prefix_iterator operator+(ptrdiff_t n) const
+    {
+        return prefix_iterator(array, at + n);
+    }
+
+    prefix_iterator operator-(ptrdiff_t n) const
+    {
+        return prefix_iterator(array, at - n);
+    }
+
+    ptrdiff_t operator-(const prefix_iterator &i) const
+    {
+        return at - i.at;
+    }
+
+    bool operator==(const prefix_iterator &i) const
+    {
+        return at == i.at;
+    }
+
+    bool operator!=(const prefix_iterator &i) const
+    {
+        return at != i.at;
+    }
+
+    bool operator<(const prefix_iterator &i) const
+    {
+        return at < i.at;
+    }
+
+    bool operator>(const prefix_iterator &i) const
+    {
+        return at > i.at;
+    }
+
+    bool operator<=(const prefix_iterator &i) const
+    {
+        return at <= i.at;
+    }
+
+    bool operator>=(const prefix_iterator &i) const
+    {
+        return at >= i.at;
+    }
+
+    Array *array;
+    ptrdiff_t at;
+};
+
+/* children of a node in prefix_nodes, laid out like a column_array until
+ * the first 8 bytes of all keys are the same, then they are kept once and
+ * every key keeps its last 8 bytes, so `packed_n` children fit instead of
+ * `N`, a key of another prefix goes in only once the node is laid out the
+ * first way again */
+template<class Element, class Ref, class Second, size_t N>
+struct prefix_array {
+    typedef typename Ref::template rebind<prefix_key<prefix_array> >::type
+        reference;
+    typedef prefix_iterator<prefix_array, Element, reference> iterator;
+
+    static const size_t packed_n = N * (sizeof(key_t) + sizeof(Second)) /
+                                   (sizeof(uint64_t) + sizeof(Second));
+
+    uint64_t prefix; /* the first word of every key when packed */
+    uint64_t packed;
+    char data[N * (sizeof(key_t) + sizeof(Second))];
+
+    operator iterator()
+    {
+        return iterator(this, 0);
+    }
+
+    iterator operator+(size_t i)
+    {
+        return iterator(this, i);
+    }
+
+    reference operator[](size_t i)
+    {
+        return reference(prefix_key<prefix_array>(this, i), second(i));
+    }
+
+    /* the reference types have no const form, nodes are only read
+     * through a const one */
+    reference operator[](size_t i) const
+    {
+        return (*const_cast<prefix_array *>(this))[i];
+    }
+
+    size_t capacity() const
+    {
+        return packed ? packed_n : N;
+    }
+
+    /* a torn read of a node that is being written still stays inside */
+    key_t key(size_t i) const
+    {
+        if (!packed)
+            return keys()[std::min(i, N - 1)];
+
+        key_t key;
+        key.set_word(0, prefix);
+        key.set_word(8, words()[std::min(i, packed_n - 1)]);
+        return key;
+    }
+
+    void set_key(size_t i, const key_t &key)
+    {
+        if (packed) {
+            assert(key.word(0) == prefix);
+            words()[i] = key.word(8);
+        } else {
+            keys()[i] = key;
+        }
+    }
+
+    Second &second(size_t i)
+    {
+        return seconds()[std::min(i, capacity() - 1)];
+    }
+
+    /* key_rank() of the `n` children from `first` on */
+    size_t rank(size_t first, size_t n, const key_t &key,
+                bool inclusive) const
+    {
+        bool is_packed = packed;
+        size_t cap = is_packed ? packed_n : N;
+        first = std::min(first, cap);
+        n = std::min(n, cap - first);
+        if (!is_packed)
+            return key_rank(keys() + first, sizeof(key_t), n, key, inclusive);
+
+        // keys of another prefix are all before or after
+        uint64_t w = key.word(0);
+        if (w != prefix)
+            return w < prefix ? 0 : n;
+        const uint64_t *begin = words() + first;
+        w = key.word(8);
+        return (inclusive ? std::upper_bound(begin, begin + n, w)
+                          : std::lower_bound(begin, begin + n, w)) - begin;
+    }
+
+    bool make_room(size_t n, const key_t &key)
+    {
+        if (packed) {
+            if (key.word(0) == prefix)
+                return n < packed_n;
+            if (n >= N)
+                return false;
+            unpack(n);
+            return true;
+        }
+        if (n < N)
+            return true;
+
+        // full, but it may go on without the first words
+        if (keys()[0].word(0) != key.word(0))
+            return false;
+        pack(n);
+        return packed && n < packed_n;
+    }
+
+    bool take_key(size_t n, const key_t &key)
+    {
+        if (!packed || key.word(0) == prefix)
+            return true;
+        if (n > N)
+            return false;
+        unpack(n);
+        return true;
+    }
+
+    template<class It>
+    size_t reshape(It first, It last)
+    {
+        packed = 0;
+        if (first == last)
+            return N;
+        uint64_t w = first->key.word(0);
+        for (It i = first; i != last; ++i) {
+            if (i->key.word(0) != w)
+                return N;
+        }
+        prefix = w;
+        packed = 1;
+        return packed_n;
+    }
+
+    void pack(size_t n)
+    {
+        if (packed || n == 0)
+            return;
+        uint64_t w = keys()[0].word(0);
+        for (size_t i = 1; i < n; i++) {
+            if (keys()[i].word(0) != w)
+                return;
+        }
+
+        uint64_t last[N];
+        Second s[N];
+        for (size_t i = 0; i < n; i++)
+            last[i] = keys()[i].word(8);
+        memcpy(s, seconds(), n * sizeof(Second));
+
+        prefix = w;
+        packed = 1;
+        memcpy(words(), last, n * sizeof(uint64_t));
+        memcpy(seconds(), s, n * sizeof(Second));
+    }
+
+    void unpack(size_t n)
+    {
+        if (!packed)
+            return;
+        assert(n <= N);
+
+        uint64_t last[N];
+        Second s[N];
+        memcpy(last, words(), n * sizeof(uint64_t));
+        memcpy(s, seconds(), n * sizeof(Second));
+
+        packed = 0;
+        for (size_t i = 0; i < n; i++) {
+            keys()[i].set_word(0, prefix);
+            keys()[i].set_word(8, last[i]);
+        }
+        memcpy(seconds(), s, n * sizeof(Second));
+    }
+
+private:
+    key_t *keys()
+    {
+        return (key_t *)data;
+    }
+
+    const key_t *keys() const
+    {
+        return (const key_t *)data;
+    }
+
+    uint64_t *words()
+    {
+        return (uint64_t *)data;
+    }
+
+    const uint64_t *words() const
+    {
+        return (const uint64_t *)data;
+    }
+
+    Second *seconds()
+    {
+        return (Second *)(data + (packed ? packed_n * sizeof(uint64_t)
+                                         : N * sizeof(key_t)));
+    }
+};
+
+/* node layouts, `row_nodes` keeps every key next to its child or value,
+ * `column_nodes` keeps the keys of a node together so a search reads
+ * nothing else, `array` is how internal nodes hold their children and
+ * `leaf_array` how leaves do, `fill()` is how many children fit in a page
+ * after `head` bytes */
+struct row_nodes {
+    template<class Element, class Ref, class Key, class Second, size_t N>
+    struct array : fixed_room<N> {
+        typedef Element type[N];
+        typedef Element *iterator;
+    };
+
+    template<class Element, class Ref, class Key, class Second, size_t N>
+    struct leaf_array : array<Element, Ref, Key, Second, N> {};
+
+    template<class Element, class Key, class Second>
+    static constexpr size_t fill(size_t head)
+    {
+        return page_fill(head, sizeof(Element));
+    }
+};
+
+struct column_nodes {
+    template<class Element, class Ref, class Key, class Second, size_t N>
+    struct array : fixed_room<N> {
+        typedef column_array<Element, Ref, Key, Second, N> type;
+        typedef typename type::iterator iterator;
+    };
+
+    template<class Element, class Ref, class Key, class Second, size_t N>
+    struct leaf_array : array<Element, Ref, Key, Second, N> {};
+
+    /* the second array may need padding */
+    template<class Element, class Key, class Second>
+    static constexpr size_t fill(size_t head)
+    {
+        return page_fill(head + sizeof(Second), sizeof(Key) + sizeof(Second));
+    }
+};
+
+/* `column_nodes` whose nodes strip the first 8 bytes all their keys
+ * share, for default keys */
+struct prefix_nodes {
+    template<class Element, class Ref, class Key, class Second, size_t N>
+    struct array {
+        static_assert(std::is_same<Key, key_t>::value,
+                      "prefix_nodes strip bytes of default keys");
+
+        typedef prefix_array<Element, Ref, Second, N> type;
+        typedef typename type::iterator iterator;
+
+        static size_t capacity(const type &a)
+        {
+            return a.capacity();
+        }
+
+        static bool make_room(type &a, size_t n, const key_t &key)
+        {
+            return a.make_room(n, key);
+        }
+
+        static bool take_key(type &a, size_t n, const key_t &key)
+        {
+            return a.take_key(n, key);
+        }
+
+        template<class It>
+        static size_t reshape(type &a, It first, It last)
+        {
+            return a.reshape(first, last);
+        }
+
+        static void pack(type &a, size_t n)
+        {
+            a.pack(n);
+        }
+
+        static void unpack(type &a, size_t n)
+        {
+            a.unpack(n);
+        }
+
+        static void clear(type &a)
+        {
+            a.packed = 0;
+        }
+    };
+
+    template<class Element, class Ref, class Key, class Second, size_t N>
+    struct leaf_array : array<Element, Ref, Key, Second, N> {};
+
+    /* the prefix, its flag and padding come first */
+    template<class Element, class Key, class Second>
+    static constexpr size_t fill(size_t head)
+    {
+        return page_fill(head + 3 * sizeof(uint64_t),
+                         sizeof(Key) + sizeof(Second));
+    }
+};
+
+/* where the keys of a run of children start and how far apart they are */
+template<class T>
+inline const key_t *first_key(T *first)
+{
+    return &first->key;
+}
+template<class T>
+inline size_t key_stride(T *)
+{
+    return sizeof(T);
+}
+template<class Element, class Ref, class Second>
+inline const key_t *first_key(
+        const column_iterator<Element, Ref, key_t, Second> &first)
+{
+    return first.keys;
+}
+template<class Element, class Ref, class Second>
+inline size_t key_stride(const column_iterator<Element, Ref, key_t, Second> &)
+{
+    return sizeof(key_t);
+}
+
+/* key_rank() of the `n` children from `first` on */
+template<class It>
+inline size_t key_rank(It first, size_t n, const key_t &key, bool inclusive)
+{
+    return key_rank(first_key(first), key_stride(first), n, key, inclusive);
+}
+template<class Array, class Element, class Ref>
+inline size_t key_rank(const prefix_iterator<Array, Element, Ref> &first,
+                       size_t n, const key_t &key, bool inclusive)
+{
+    return first.array->rank(first.at, n, key, inclusive);
+}
+
+/* in-node search, `lower` and `upper` work like std::lower_bound() and
+ * std::upper_bound() */
+template<class Key, class Compare>
+struct node_search {
+    template<class It>
+    static It lower(It first, It last, const Key &key)
+    {
+        return std::lower_bound(first, last, key);
+    }
+
+    template<class It>
+    static It upper(It first, It last, const Key &key)
+    {
+        return std::upper_bound(first, last, key);
+    }
+};
+
+/* default keys in their default order */
+template<>
+struct node_search<key_t, key_compare> {
+    template<class It>
+    static It lower(It first, It last, const key_t &key)
+    {
+        return first + key_rank(first, last - first, key, false);
+    }
+
+    template<class It>
+    static It upper(It first, It last, const key_t &key)
+    {
+        return first + key_rank(first, last - first, key, true);
+    }
+};
+
+/* helper iterating function */
+template<class T>
+inline typename T::child_t begin(T &node) {
+    return node.children;
+}
+template<class T>
+inline typename T::child_t end(T &node) {
+    return node.children + node.n;
+}
+
+/* lets the STL algorithms compare keys with indexes and records, lookup
+ * from inside those structs finds the tree's keycmp() */
+#define OPERATOR_KEYCMP(type) \
+    friend bool operator< (const key_t &l, const type &r) {\
+        return keycmp(l, r.key) < 0;\
+    }\
+    friend bool operator< (const type &l, const key_t &r) {\
+        return keycmp(l.key, r) < 0;\
+    }\
+    friend bool operator== (const key_t &l, const type &r) {\
+        return keycmp(l, r.key) == 0;\
+    }\
+    friend bool operator== (const type &l, const key_t &r) {\
+        return keycmp(l.key, r) == 0;\
+    }
+
+/* the encapulated B+ tree, `Compare` orders keys, key_compare does so for
+ * key_t strings and u64_key or i64_key integers, the empty `Key()` is never
+ * stored, every tree type has its own node layout, `Layout` is row_nodes
+ * or column_nodes */
+template<class Key = key_t, class Value = value_t, size_t Order = 0,
+         class Compare = key_compare, class Layout = row_nodes>
+class bplus_tree {
+public:
+    typedef Key key_t;
+    typedef Value value_t;
+
+    static int keycmp(const key_t &a, const key_t &b)
+    {
+        return Compare()(a, b);
+    }
+
+    /* internal nodes' index segment */
+    struct index_t {
+        key_t key;
+        off_t child; /* child's offset */
+
+        OPERATOR_KEYCMP(index_t)
+    };
+
+    /* the final record of value */
+    struct record_t {
+        key_t key;
+        value_t value;
+
+        OPERATOR_KEYCMP(record_t)
+    };
+
+    /* an index or record of a node in column layout, assigning to it
+     * writes the node, `KeyRef` is key_t & unless the layout keeps keys
+     * some other way */
+    template<class KeyRef>
+    struct basic_index_ref {
+        KeyRef key;
+        off_t &child;
+
+        basic_index_ref(KeyRef k, off_t &c) : key(k), child(c) {}
+
+        basic_index_ref &operator=(const basic_index_ref &r)
+        {
+            key = r.key;
+            child = r.child;
+            return *this;
+        }
+
+        basic_index_ref &operator=(const index_t &r)
+        {
+            key = r.key;
+            child = r.child;
+            return *this;
+        }
+
+        operator index_t() const
+        {
+            index_t r;
+            r.key = key;
+            r.child = child;
+            return r;
+        }
+
+        template<class K>
+        struct rebind {
+            typedef basic_index_ref<K> type;
+        };
+
+        OPERATOR_KEYCMP(basic_index_ref)
+    };
+    typedef basic_index_ref<key_t &> index_ref;
+
+    template<class KeyRef>
+    struct basic_record_ref {
+        KeyRef key;
+        value_t &value;
+
+        basic_record_ref(KeyRef k, value_t &v) : key(k), value(v) {}
+
+        basic_record_ref &operator=(const basic_record_ref &r)
+        {
+            key = r.key;
+            value = r.value;
+            return *this;
+        }
+
+        basic_record_ref &operator=(const record_t &r)
+        {
+            key = r.key;
+            value = r.value;
+            return *this;
+        }
+
+        operator record_t() const
+        {
+            record_t r;
+            r.key = key;
+            r.value = value;
+            return r;
+        }
+
+        template<class K>
+        struct rebind {
+            typedef basic_record_ref<K> type;
+        };
+
+        OPERATOR_KEYCMP(basic_record_ref)
+    };
+    typedef basic_record_ref<key_t &> record_ref;
+
+    /* what nodes have before their children */
+    struct internal_head_t {
+        off_t next;
+        off_t prev;
+        size_t n;
+    };
+    struct leaf_head_t {
+        off_t next;
+        off_t prev;
+        size_t n;
+        key_t high;
+    };
+
+    /* children a node holds, `Order` 0 fills a page of BP_PAGE_SIZE */
+    static const size_t order =
+        Order != 0 ? Order
+        : Layout::template fill<index_t, key_t, off_t>(
+              sizeof(internal_head_t)) <
+          Layout::template fill<record_t, key_t, value_t>(
+              sizeof(leaf_head_t))
+        ? Layout::template fill<index_t, key_t, off_t>(
+              sizeof(internal_head_t))
+        : Layout::template fill<record_t, key_t, value_t>(
+              sizeof(leaf_head_t));
+
+    typedef typename Layout::template array<index_t, index_ref, key_t, off_t,
+                                            order> index_array;
+    typedef typename Layout::template leaf_array<record_t, record_ref, key_t,
+                                                 value_t, order> record_array;
+
+    /***
+     * internal node block
+     ***/
+    struct internal_node_t {
+        typedef typename index_array::iterator child_t;
 
-/* offsets */
-#define OFFSET_META 0
-#define OFFSET_BLOCK OFFSET_META + sizeof(meta_t)
-#define SIZE_NO_CHILDREN sizeof(leaf_node_t) - BP_ORDER * sizeof(record_t)
+        off_t next;
+        off_t prev;
+        size_t n; /* how many children */
+        typename index_array::type children;
+    };
 
-/* meta information of B+ tree */
-typedef struct {
-    size_t order; /* `order` of B+ tree */
-    size_t value_size; /* size of value */
-    size_t key_size;   /* size of key */
-    size_t internal_node_num; /* how many internal nodes */
-    size_t leaf_node_num;     /* how many leafs */
-    size_t height;            /* height of tree (exclude leafs) */
-    off_t slot;        /* where to store new block */
-    off_t root_offset; /* where is the root of internal nodes */
-    off_t leaf_offset; /* where is the first leaf */
-} meta_t;
+    /* leaf node block */
+    struct leaf_node_t {
+        typedef typename record_array::iterator child_t;
 
-/* internal nodes' index segment */
-struct index_t {
-    key_t key;
-    off_t child; /* child's offset */
-};
+        off_t next;
+        off_t prev;
+        size_t n;
+        key_t high; /* first key of the next leaf, empty for the last one */
+        typename record_array::type children;
+    };
 
-/***
- * internal node block
- ***/
-struct internal_node_t {
-    typedef index_t * child_t;
+    /* where indexes and records of a node are */
+    typedef typename internal_node_t::child_t index_iterator;
+    typedef typename leaf_node_t::child_t record_iterator;
 
-    off_t parent; /* parent node offset */
-    off_t next;
-    off_t prev;
-    size_t n; /* how many children */
-    index_t children[BP_ORDER];
-};
+    /* every node takes a whole block, so none straddles a page */
+    static const size_t block_size = page_block(
+        sizeof(internal_node_t) > sizeof(leaf_node_t)
+        ? sizeof(internal_node_t) : sizeof(leaf_node_t));
 
-/* the final record of value */
-struct record_t {
-    key_t key;
-    value_t value;
-};
+    /* blocks start past the meta, at a multiple of their size */
+    static const off_t block_start =
+        (sizeof(meta_t) + block_size - 1) / block_size * block_size;
 
-/* leaf node block */
-struct leaf_node_t {
-    typedef record_t *child_t;
+    /* what a node has before its children */
+    static const size_t header_size = offsetof(leaf_node_t, children);
 
-    off_t parent; /* parent node offset */
-    off_t next;
-    off_t prev;
-    size_t n;
-    record_t children[BP_ORDER];
-};
+    static_assert(order > 2, "a node must hold at least three children");
+    static_assert((BP_PAGE_SIZE & (BP_PAGE_SIZE - 1)) == 0,
+                  "BP_PAGE_SIZE must be a power of two");
 
-/* the encapulated B+ tree */
-class bplus_tree {
-public:
-    bplus_tree(const char *path, bool force_empty = false);
+    /* `cache_size` 0 takes the one of `options` */
+    bplus_tree(const char *path, bool force_empty = false,
+               size_t cache_size = 0, int flags = 0,
+               const options_t &options = default_options());
+    ~bplus_tree();
 
     /* abstract operations */
     int search(const key_t& key, value_t *value) const;
     int search_range(key_t *left, const key_t &right,
                      value_t *values, size_t max, bool *next = NULL) const;
+
+    /* search many keys at once, `status` gets what search() would return
+     * for each key, returns how many keys are found */
+    int search_many(const key_t *keys, value_t *values, int *status,
+                    size_t n) const;
     int remove(const key_t& key);
+
+    /* returns -1 for the empty key, it can't be stored */
     int insert(const key_t& key, value_t value);
+
+    /* insert many records, returns how many keys were new, or -1 without
+     * inserting any if one is empty */
+    int insert_batch(const record_t *records, size_t n);
     int update(const key_t& key, value_t value);
+
+    /* rewrite the file with leaves in key order and no free blocks, waits
+     * for the snapshots to be dropped first */
+    int compact();
+
+    /* BP_WAL and BP_COW: sync the log or commit after `ops` writes or
+     * when the oldest unsynced one is `ms` milliseconds old, whichever
+     * comes first, writes since the last sync are lost on a crash, a
+     * BP_COW tree without BP_THREAD_SAFE checks the age on writes only */
+    void set_group_commit(size_t ops, unsigned ms);
+
+    /* make every finished write durable now, fails inside a transaction */
+    int sync();
+
+    /* writes until commit_transaction() stay in memory and every block
+     * they touch is written once on commit, only one thread may use a
+     * transaction, returns -1 if one is open or the tree is BP_THREAD_SAFE */
+    int begin_transaction();
+    int commit_transaction();
+
+    /* forget every write since begin_transaction() */
+    void abort_transaction();
+
+    /* the file is open and holds a tree of this node layout, otherwise
+     * every operation returns -1 and the file is left alone */
+    bool good() const
+    {
+        return fd != -1;
+    }
+
     meta_t get_meta() const {
         return meta;
     };
 
+    class read_view;
+
+    /* ordered walk over records, keeps the current leaf in memory */
+    class cursor {
+    public:
+        cursor(const bplus_tree &t)
+            : tree(t), snap(NULL), offset(0), pos(0), seq(0)
+        {
+            leaf.n = 0;
+            leaf.next = leaf.prev = 0;
+        }
+
+        /* walk a snapshot instead */
+        cursor(const read_view &v);
+
+        /* move to the first record not less than `key` */
+        bool seek(const key_t &key);
+        bool seek_first();
+
+        /* move to the last record less than `key` */
+        bool seek_before(const key_t &key);
+        bool seek_last();
+
+        bool valid() const
+        {
+            return pos < leaf.n;
+        }
+
+        bool next();
+
+        /* step backwards, also works from the end of the tree */
+        bool prev();
+
+        key_t key() const
+        {
+            return leaf.children[pos].key;
+        }
+
+        value_t value() const
+        {
+            return leaf.children[pos].value;
+        }
+
+    private:
+        const bplus_tree &tree;
+        const snapshot_t *snap;
+        leaf_node_t leaf;
+        off_t offset;
+        size_t pos;
+        unsigned long seq; /* structure version the leaf was read at */
+
+        /* read the leaf holding `key`, or the last leaf if NULL */
+        void locate(const key_t *key);
+        void load(off_t offset);
+        void skip_empty();
+
+        /* the links of the leaf may point to nodes merged away since */
+        bool stale() const
+        {
+            return snap == NULL && !tree.structure_valid(seq);
+        }
+    };
+
+    /* the last `max` records before `key` in descending order, returns
+     * how many are found */
+    int search_before(const key_t &key, key_t *keys, value_t *values,
+                      size_t max) const;
+
+    /* read-only view of the tree as it is now, writers go on without
+     * waiting for it, it must not outlive the tree */
+    class read_view {
+    public:
+        read_view(const read_view &v);
+        ~read_view();
+
+        /* same as the ones of the tree */
+        int search(const key_t &key, value_t *value) const;
+        int search_range(key_t *left, const key_t &right, value_t *values,
+                         size_t max, bool *next = NULL) const;
+
+    private:
+        friend class bplus_tree;
+        friend class cursor;
+
+        read_view(const bplus_tree &t, snapshot_t *s) : tree(t), snap(s) {}
+
+        const bplus_tree &tree;
+        snapshot_t *snap;
+
+        read_view &operator=(const read_view &);
+    };
+
+    /* waits for splits and merges in progress, not for the view's reads */
+    read_view snapshot() const;
+
+    class bulk_loader;
+
 #ifndef UNIT_TEST
 private:
 #else
 public:
 #endif
+    /* in-node search of indexes or records */
+    template<class It>
+    static It lower_bound(It first, It last, const key_t &key)
+    {
+        return node_search<Key, Compare>::lower(first, last, key);
+    }
+
+    template<class It>
+    static It upper_bound(It first, It last, const key_t &key)
+    {
+        return node_search<Key, Compare>::upper(first, last, key);
+    }
+
+    /* helper searching function */
+    static index_iterator find(internal_node_t &node, const key_t &key) {
+        if (key) {
+            return upper_bound(begin(node), end(node) - 1, key);
+        }
+        // because the end of the index range is an empty string, so if we search the empty key(when merge internal nodes), we need to return the second last one
+        if (node.n > 1) {
+            return node.children + node.n - 2;
+        }
+        return begin(node);
+    }
+    static record_iterator find(leaf_node_t &node, const key_t &key) {
+        return lower_bound(begin(node), end(node), key);
+    }
+
+    static bool contains(leaf_node_t &node, const key_t &key) {
+        record_iterator record = find(node, key);
+        return record != end(node) && keycmp(record->key, key) == 0;
+    }
+
+    /* the last key of an internal node is the first key after it */
+    static key_t high_key(internal_node_t &node) {
+        return (end(node) - 1)->key;
+    }
+
+    static key_t high_key(leaf_node_t &node) {
+        return node.high;
+    }
+
+    /* equal keys, the empty key is only equal to itself */
+    static bool same_key(const key_t &a, const key_t &b) {
+        return a ? b && keycmp(a, b) == 0 : !b;
+    }
+
+    /* key belongs right of a node, an empty high key ends the level */
+    static bool beyond(const key_t &high, const key_t &key) {
+        return high && keycmp(key, high) >= 0;
+    }
+
+    static bool record_less(const record_t &l, const record_t &r) {
+        return keycmp(l.key, r.key) < 0;
+    }
+
+    /* orders indexes by the keys they point to */
+    struct key_index_less {
+        const key_t *keys;
+
+        key_index_less(const key_t *k) : keys(k) {}
+
+        bool operator()(size_t l, size_t r) const {
+            return keycmp(keys[l], keys[r]) < 0;
+        }
+    };
+
+    /* search_range() over whatever the cursor walks */
+    static int scan_range(cursor &c, key_t *left, const key_t &right,
+                          value_t *values, size_t max, bool *next);
+
     char path[512];
     meta_t meta;
 
+    /* cache of blocks, all map()/unmap() go through it */
+    mutable buffer_pool pool;
+
+    /* BP_THREAD_SAFE: inserts, removes and updates hold the tree latch
+     * shared, splits follow the B-link protocol, removes that underflow
+     * latch the nodes they change from the top down, readers take no
+     * latches and check node versions and `structure_seq` instead */
+    bool concurrent;
+    mutable pthread_rwlock_t tree_latch;
+    mutable pthread_mutex_t pool_mutex;
+    mutable latch_table latches;
+
+    /* readers in progress counted by thread on lines of their own, so
+     * they don't share a cache line the way a read latch would, only the
+     * holder of the exclusive tree latch waits for them to get out */
+    struct reader_slot {
+        unsigned long n;
+        char pad[64 - sizeof(unsigned long)];
+    };
+    enum { reader_slots = 64 };
+    mutable reader_slot readers[reader_slots];
+
+    /* set while the exclusive holder waits for readers, new ones wait */
+    mutable int draining;
+    class read_scope;
+
+    void drain_readers() const;
+
+    /* guards meta while splits allocate blocks, recursive */
+    mutable pthread_mutex_t meta_mutex;
+
+    /* odd while root_offset and height are changing */
+    mutable unsigned root_seq;
+
+    /* what the tree was created with */
+    options_t options;
+
+    /* BP_WAL: writes not synced yet and when the first one finished */
+    mutable write_ahead_log wal;
+    size_t commit_ops;
+    unsigned commit_ms;
+    size_t pending;
+    unsigned long pending_since;
+    pthread_mutex_t commit_mutex;
+
+    /* commits what is pending once it is `commit_ms` old, even when no
+     * write comes after it, signalled on the first pending write */
+    pthread_cond_t commit_cond;
+    pthread_t flusher;
+    bool flushing;
+    bool closing;
+    static void *flush_loop(void *arg);
+
+    /* logs the writes of one operation and commits it on the way out */
+    class log_scope;
+
+    /* transaction in progress, the blocks it wrote and meta before it */
+    bool in_transaction;
+    mutable std::map<off_t, dirty_block_t> dirty_blocks;
+    meta_t committed_meta;
+
+    /* block written in the transaction, NULL if it is not */
+    char *dirty_block(off_t offset) const
+    {
+        std::map<off_t, dirty_block_t>::iterator i = dirty_blocks.find(offset);
+        return i != dirty_blocks.end() ? &i->second.data[0] : NULL;
+    }
+
+    /* keep a write of the transaction */
+    void stage(const void *block, off_t offset, size_t size) const;
+
+    /* count a finished operation and sync the log if the group is full */
+    void commit(bool force = false);
+
+    /* write back every block and empty the log */
+    int checkpoint();
+
+    /* live snapshots, unmap() saves blocks for them while there are any */
+    mutable std::vector<snapshot_t *> snapshots;
+    mutable int snapshot_count;
+    mutable pthread_mutex_t snapshot_mutex;
+
+    /* signalled when the last snapshot is dropped */
+    mutable pthread_cond_t snapshot_cond;
+
+    /* saved blocks in `path`.snap, unlinked as soon as it is open and
+     * emptied when no snapshot is left, a block saved for many snapshots
+     * is written once and counted */
+    mutable int spill_fd;
+    mutable off_t spill_end;
+    mutable std::unordered_map<off_t, int> spill_refs;
+    mutable std::vector<off_t> spill_free;
+
+    /* write a saved block to the spill file, returns where or -1 */
+    off_t spill(const char *block) const;
+
+    /* save the block at `offset` for every snapshot that still sees it */
+    void preserve(off_t offset) const;
+
+    /* the whole block including what is not cached, zeros past the file */
+    void read_whole(off_t offset, char *block) const;
+    void drop_snapshot(snapshot_t *s) const;
+
+    /* read a block as it was when `s` was taken */
+    int map(const snapshot_t &s, void *block, off_t offset,
+            size_t size) const;
+
+    template<class T>
+    int map(const snapshot_t &s, T *block, off_t offset) const
+    {
+        return map(s, block, offset, sizeof(T));
+    }
+
+    /* descend() in a snapshot, nothing is half split there */
+    off_t descend(const snapshot_t &s, const key_t *key) const;
+
+    /* BP_COW: the blocks, the map and the last commit on disk */
+    bool cow;
+    mutable shadow_map shadow;
+    commit_t last_commit;
+
+    /* read the newest commit, returns -1 if there is none */
+    int load_commit();
+
+    /* write back every block and switch to a new commit */
+    int commit_shadow();
+
+    /* blocks are all of the same size, so the map is indexed by offset */
+    size_t block_index(off_t offset) const
+    {
+        return (offset - block_start) / block_size;
+    }
+
+    /* where `offset` is in the file, -1 if it was never written */
+    off_t physical(off_t offset) const
+    {
+        if (!cow)
+            return offset;
+
+        off_t slot = shadow.slot(block_index(offset));
+        return slot == 0 ? -1
+                         : slot + (offset - block_start) % block_size;
+    }
+
+    /* meta is written with every commit in BP_COW mode */
+    void save_meta()
+    {
+        if (!cow)
+            unmap(&meta, OFFSET_META);
+    }
+
+    void lock_meta() const
+    {
+        if (concurrent)
+            pthread_mutex_lock(&meta_mutex);
+    }
+
+    void unlock_meta() const
+    {
+        if (concurrent)
+            pthread_mutex_unlock(&meta_mutex);
+    }
+
+    /* consistent root and height while other threads may grow the tree */
+    void root(off_t *offset, size_t *height) const;
+
+    /* odd while a borrow or merge moves keys to the left or frees a
+     * node, which the B-link protocol can't cover, and bumped when the
+     * whole tree changes, what is read across nodes is checked against
+     * it before anything found there is followed */
+    mutable unsigned long structure_seq;
+
+    /* version to check reads across nodes against, waits while keys move */
+    unsigned long structure_begin() const
+    {
+        if (!concurrent)
+            return structure_seq;
+
+        unsigned long s;
+        while ((s = __atomic_load_n(&structure_seq, __ATOMIC_ACQUIRE)) & 1)
+            sched_yield();
+        return s;
+    }
+
+    /* false if keys may have moved since structure_begin() */
+    bool structure_valid(unsigned long s) const
+    {
+        if (!concurrent)
+            return structure_seq == s;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&structure_seq, __ATOMIC_RELAXED) == s;
+    }
+
+    /* one borrow or merge at a time, the caller holds every latch it
+     * needs before, so nothing waits for a latch while it is odd */
+    void structure_lock() const
+    {
+        if (!concurrent) {
+            ++structure_seq;
+            return;
+        }
+
+        for (;;) {
+            unsigned long s = __atomic_load_n(&structure_seq,
+                                              __ATOMIC_RELAXED);
+            if (!(s & 1) && __atomic_compare_exchange_n(&structure_seq, &s,
+                    s + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                break;
+            sched_yield();
+        }
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    void structure_unlock() const
+    {
+        __atomic_add_fetch(&structure_seq, 1, __ATOMIC_RELEASE);
+    }
+
+    /* versions of nodes by offset, odd while the node is being written,
+     * nodes sharing a slot only cause extra retries */
+    mutable unsigned long node_versions[1024];
+
+    unsigned long *node_version(off_t offset) const
+    {
+        return node_versions + (((size_t)offset * 0x9e3779b97f4a7c15ULL) >> 54);
+    }
+
+    /* version to check what is read from the node against, waits while
+     * the node is written */
+    unsigned long optimistic_begin(off_t offset) const
+    {
+        if (!concurrent)
+            return 0;
+
+        unsigned long v;
+        while ((v = __atomic_load_n(node_version(offset),
+                                    __ATOMIC_ACQUIRE)) & 1)
+            sched_yield();
+        return v;
+    }
+
+    /* false if the node was written since optimistic_begin() */
+    bool optimistic_valid(off_t offset, unsigned long v) const
+    {
+        if (!concurrent)
+            return true;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(node_version(offset), __ATOMIC_RELAXED) == v;
+    }
+
+    void version_lock(off_t offset) const
+    {
+        if (!concurrent)
+            return;
+
+        unsigned long *p = node_version(offset);
+        for (;;) {
+            unsigned long v = __atomic_load_n(p, __ATOMIC_RELAXED);
+            if (!(v & 1) && __atomic_compare_exchange_n(p, &v, v + 1, false,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                break;
+            sched_yield();
+        }
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    void version_unlock(off_t offset) const
+    {
+        if (concurrent)
+            __atomic_add_fetch(node_version(offset), 1, __ATOMIC_RELEASE);
+    }
+
+    class tree_lock;
+
+    latch_t *latch(off_t offset, bool exclusive) const
+    {
+        return concurrent ? latches.acquire(offset, exclusive) : NULL;
+    }
+
+    void unlatch(latch_t *latch) const
+    {
+        if (latch != NULL)
+            latches.release(latch);
+    }
+
+    /* walk down to the node covering `key` at `level` (0 for leaves), or
+     * the last node if NULL, moving right past splits that are not in the
+     * parent yet, internal nodes passed are pushed to `path`, `seq` gets
+     * the structure version of the walk, returns 0 if the tree is not
+     * that high yet */
+    off_t descend(const key_t *key, size_t level, std::vector<off_t> *path,
+                  unsigned long *seq = NULL) const;
+
+    /* same to the leaf, which is returned latched for writing */
+    off_t latch_leaf(const key_t *key, latch_t **latch,
+                     std::vector<off_t> *path = NULL,
+                     unsigned long *seq = NULL) const;
+
+    /* latch the child of `parent` covering `key` and the ones next to it
+     * under the same parent into `nodes`, `offsets` and `held`, left to
+     * right, 0 where there is none, false if one of them was split and
+     * the parent doesn't know yet */
+    template<class T>
+    bool latch_family(internal_node_t &parent, const key_t &key, T *nodes,
+                      off_t *offsets, latch_t **held) const;
+
+    /* remove `key` from a leaf that underflows, the lowest node that
+     * keeps enough children and everything below it that may change are
+     * latched first, returns 1 if the tree changed and it must start over */
+    int remove_latched(const key_t &key);
+
+    /* copy of a node no writer was in the middle of */
+    template<class T>
+    int map_optimistic(T *block, off_t offset) const
+    {
+        for (;;) {
+            unsigned long v = optimistic_begin(offset);
+            int ret = map(block, offset);
+            if (optimistic_valid(offset, v))
+                return ret;
+        }
+    }
+
+    /* compact() once no snapshot is left and the tree latch is held */
+    int compact_latched(const char *tmp);
+
+    /* reopen the file after it has been replaced */
+    void reopen();
+
+    bplus_tree(const bplus_tree &);
+    bplus_tree &operator=(const bplus_tree &);
+
     /* init empty tree */
     void init_from_empty();
 
-    /* find index */
-    off_t search_index(const key_t &key) const;
+    /* meta of a tree with no blocks yet */
+    void empty_meta();
+
+    /* the file was written by a tree of this very node layout */
+    bool same_layout() const
+    {
+        return meta.order == order && meta.key_size == sizeof(key_t) &&
+               meta.value_size == sizeof(value_t) &&
+               meta.page_size == BP_PAGE_SIZE;
+    }
+
+    /* find index, `upper` narrows to the first key after the subtree and
+     * stays untouched when the subtree is the last one */
+    off_t search_index(const key_t &key, key_t *upper = NULL) const;
 
     /* find leaf */
-    off_t search_leaf(off_t index, const key_t &key) const;
+    off_t search_leaf(off_t index, const key_t &key,
+                      key_t *upper = NULL) const;
+
     off_t search_leaf(const key_t &key) const
     {
         return search_leaf(search_index(key), key);
     }
 
-    /* remove internal node */
-    void remove_from_index(off_t offset, internal_node_t &node,
-                           const key_t &key);
+    /* remove internal node, `path` holds the latched nodes above it */
+    void remove_from_index(std::vector<off_t> path, off_t offset,
+                           internal_node_t &node, const key_t &key);
 
-    /* borrow one key from other internal node */
+    /* borrow one key from other internal node under the same `parent` */
     bool borrow_key(bool from_right, internal_node_t &borrower,
-                    off_t offset);
+                    off_t parent);
 
-    /* borrow one record from other leaf */
-    bool borrow_key(bool from_right, leaf_node_t &borrower);
+    /* borrow one record from other leaf under the same parent, `path`
+     * leads to the borrower */
+    bool borrow_key(bool from_right, leaf_node_t &borrower,
+                    const std::vector<off_t> &path);
 
-    /* change one's parent key to another key */
-    void change_parent_child(off_t parent, const key_t &o, const key_t &n);
+    /* change the key after the child holding `o` to `n`, and the same
+     * key further up `path` as long as it is the high key, false without
+     * changing anything if the parent can't take `n` */
+    bool change_parent_child(std::vector<off_t> path, const key_t &o,
+                             const key_t &n);
 
     /* merge right leaf to left leaf */
     void merge_leafs(leaf_node_t *left, leaf_node_t *right);
 
-    void merge_keys(index_t *where, internal_node_t &left,
+    void merge_keys(index_iterator where, internal_node_t &left,
                     internal_node_t &right, bool change_where_key = false);
 
     /* insert into leaf without split */
     void insert_record_no_split(leaf_node_t *leaf,
                                 const key_t &key, const value_t &value);
 
-    /* add key to the internal node */
-    void insert_key_to_index(off_t offset, const key_t &key,
-                             off_t value, off_t after);
+    /* add `key` pointing to `after`, the new right sibling of `old` at
+     * `level`, to the level above, `path` is where we came down at
+     * structure version `seq` */
+    void insert_key_to_index(std::vector<off_t> path, unsigned long seq,
+                             size_t level, key_t key, off_t old, off_t after);
+
+    /* put a new root above `old`, false if it is not the root */
+    bool grow_root(size_t level, const key_t &key, off_t old, off_t after);
+
+    /* switch to another root, meta is locked */
+    void set_root(off_t offset, size_t height);
     void insert_key_to_index_no_split(internal_node_t &node, const key_t &key,
                                       off_t value);
 
-    /* change children's parent */
-    void reset_index_children_parent(index_t *begin, index_t *end,
-                                     off_t parent);
-
+    /* new sibling after node, the caller writes both and then points
+     * the old next back with set_prev() */
     template<class T>
     void node_create(off_t offset, T *node, T *next);
 
+    template<class T>
+    void set_prev(T *node, off_t offset, off_t prev);
+
     template<class T>
     void node_remove(T *prev, T *node);
 
-    /* multi-level file open/close */
-    mutable FILE *fp;
-    mutable int fp_level;
-    void open_file(const char *mode = "rb+") const
-    {
-        // `rb+` will make sure we can write everywhere without truncating file
-        if (fp_level == 0)
-            fp = fopen(path, mode);
+    /* database file, open for the whole lifetime of the tree */
+    int fd;
 
-        ++fp_level;
-    }
+    /* the file mapping in BP_MMAP mode, NULL otherwise, published
+     * atomically so readers never need a latch to follow it */
+    char *base;
+    size_t mapped;
 
-    void close_file() const
-    {
-        if (fp_level == 1)
-            fclose(fp);
+    /* smaller mappings of the same file, readers may still be inside
+     * them, unmapped only when no reader can be */
+    std::vector<std::pair<char *, size_t> > retired;
+
+    /* grow file and mapping to hold at least `size` bytes, called
+     * with meta locked */
+    void remap(size_t size);
 
-        --fp_level;
+    /* unmap the current and all retired mappings */
+    void unmap_all();
+
+    char *mapping() const
+    {
+        return __atomic_load_n(&base, __ATOMIC_ACQUIRE);
     }
 
-    /* alloc from disk */
-    off_t alloc(size_t size)
+    /* alloc from disk, every node takes a whole block */
+    off_t alloc()
     {
         off_t slot = meta.slot;
-        meta.slot += size;
+        meta.slot += block_size;
+        if (base != NULL && (size_t)meta.slot > mapped)
+            remap(meta.slot);
+        return slot;
+    }
+
+    /* reuse a freed block, every free block stores the next one first */
+    off_t alloc(off_t *free_list)
+    {
+        if (*free_list == 0)
+            return alloc();
+
+        off_t slot = *free_list;
+        map(free_list, slot, sizeof(off_t));
         return slot;
     }
 
     off_t alloc(leaf_node_t *leaf)
     {
         leaf->n = 0;
+        record_array::clear(leaf->children);
         meta.leaf_node_num++;
-        return alloc(sizeof(leaf_node_t));
+        return alloc(&meta.free_leaf);
     }
 
     off_t alloc(internal_node_t *node)
     {
         node->n = 1;
+        index_array::clear(node->children);
         meta.internal_node_num++;
-        return alloc(sizeof(internal_node_t));
+        return alloc(&meta.free_internal);
+    }
+
+    void unalloc(off_t offset, off_t *free_list)
+    {
+        unmap(free_list, offset, sizeof(off_t));
+        *free_list = offset;
     }
 
     void unalloc(leaf_node_t *leaf, off_t offset)
     {
         --meta.leaf_node_num;
+        unalloc(offset, &meta.free_leaf);
     }
 
     void unalloc(internal_node_t *node, off_t offset)
     {
         --meta.internal_node_num;
+        unalloc(offset, &meta.free_internal);
+    }
+
+    /* pin cached block, read the missing part from disk if `load` */
+    frame_t *pin(off_t offset, size_t size, bool load) const;
+
+    /* pin for a write and log it first */
+    frame_t *pin_logged(const void *block, off_t offset, size_t size) const;
+    void unpin(frame_t *frame, bool dirty) const
+    {
+        if (concurrent)
+            pthread_mutex_lock(&pool_mutex);
+        pool.unpin(frame, dirty);
+        if (concurrent)
+            pthread_mutex_unlock(&pool_mutex);
     }
 
+    /* write back all dirty blocks, returns -1 if one of them can't be,
+     * it stays dirty then */
+    int flush() const;
+    int write_back(frame_t *frame) const;
+
+    /* a block evicted from the cache never reached the file, nothing
+     * may be committed or taken out of the log from then on */
+    mutable bool write_failed;
+
     /* read block from disk */
+    int read_block(void *block, off_t offset, size_t size) const
+    {
+        off_t at = physical(offset);
+        if (at < 0)
+            return -1;
+        ssize_t rd = pread(fd, block, size, at);
+        return rd == (ssize_t)size ? 0 : -1;
+    }
+
+    /* write block to disk */
+    int write_block(const void *block, off_t offset, size_t size) const
+    {
+        off_t at = physical(offset);
+        if (at < 0)
+            return -1;
+        ssize_t wd = pwrite(fd, block, size, at);
+        return wd == (ssize_t)size ? 0 : -1;
+    }
+
+    /* read block, writes of the transaction first */
     int map(void *block, off_t offset, size_t size) const
     {
-        open_file();
-        fseek(fp, offset, SEEK_SET);
-        size_t rd = fread(block, size, 1, fp);
-        close_file();
+        if (in_transaction) {
+            const char *dirty = dirty_block(offset);
+            if (dirty != NULL) {
+                memcpy(block, dirty, size);
+                return 0;
+            }
+        }
+
+        return fetch(block, offset, size);
+    }
+
+    /* read block through cache or mapping */
+    int fetch(void *block, off_t offset, size_t size) const
+    {
+        char *m = mapping();
+        if (m != NULL) {
+            memcpy(block, m + offset, size);
+            return 0;
+        }
+
+        frame_t *frame = pin(offset, size, true);
+        if (frame == NULL)
+            return -1;
 
-        return rd - 1;
+        memcpy(block, frame->data, size);
+        unpin(frame, false);
+        return 0;
     }
 
     template<class T>
@@ -214,15 +2097,34 @@ public:
         return map(block, offset, sizeof(T));
     }
 
-    /* write block to disk */
+    /* write block through cache or mapping */
     int unmap(void *block, off_t offset, size_t size) const
     {
-        open_file();
-        fseek(fp, offset, SEEK_SET);
-        size_t wd = fwrite(block, size, 1, fp);
-        close_file();
+        if (in_transaction) {
+            stage(block, offset, size);
+            return 0;
+        }
+
+        if (__atomic_load_n(&snapshot_count, __ATOMIC_ACQUIRE) > 0)
+            preserve(offset);
 
-        return wd - 1;
+        char *m = mapping();
+        if (m != NULL) {
+            version_lock(offset);
+            memcpy(m + offset, block, size);
+            version_unlock(offset);
+            return 0;
+        }
+
+        // a frame pinned without loading is garbage until the copy, a
+        // reader finding it must see the version move
+        version_lock(offset);
+        frame_t *frame = wal.logging() ? pin_logged(block, offset, size)
+                                        : pin(offset, size, false);
+        memcpy(frame->data, block, size);
+        version_unlock(offset);
+        unpin(frame, true);
+        return 0;
     }
 
     template<class T>
@@ -230,8 +2132,71 @@ public:
     {
         return unmap(block, offset, sizeof(T));
     }
+
+    /* read block in place without copying, `frame` must be released */
+    template<class T>
+    T *view(off_t offset, frame_t **frame) const
+    {
+        *frame = NULL;
+        if (in_transaction) {
+            char *dirty = dirty_block(offset);
+            if (dirty != NULL)
+                return (T *)dirty;
+        }
+        char *m = mapping();
+        if (m != NULL)
+            return (T *)(m + offset);
+
+        *frame = pin(offset, sizeof(T), true);
+        return (T *)(*frame)->data;
+    }
+
+    void release(frame_t *frame) const
+    {
+        if (frame != NULL)
+            unpin(frame, false);
+    }
+};
+
+/* builds a tree bottom-up from records in ascending key order, the tree
+ * is emptied first and every level is written to consecutive blocks */
+template<class K, class V, size_t N, class C, class L>
+class bplus_tree<K, V, N, C, L>::bulk_loader {
+public:
+    /* `fill` is the fraction of each node to use, 1 packs nodes full */
+    bulk_loader(bplus_tree &tree, double fill = 1.0);
+
+    /* returns -1 if key is empty or not greater than the previous one */
+    int add(const key_t &key, value_t value);
+
+    /* write the remaining nodes, must be called once after the last add */
+    void finish();
+
+private:
+    bplus_tree &tree;
+    double fill;
+
+    leaf_node_t prev, leaf; /* the last two leaves, not written yet */
+    off_t prev_off, leaf_off;
+    bool has_prev;
+
+    key_t last;
+    size_t count;
+
+    /* first key and offset of every node in the level being built */
+    std::vector<index_t> level;
+
+    size_t per_node(size_t room) const;
+    void write_leaf(leaf_node_t &node, off_t offset, off_t next,
+                    const key_t &high);
+    void build_level();
+
+    bulk_loader(const bulk_loader &);
+    bulk_loader &operator=(const bulk_loader &);
 };
 
 }
 
+#include "bpt_impl.h"
+
 #endif /* end of BPT_H */
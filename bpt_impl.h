@@ -0,0 +1,2568 @@
+#ifndef BPT_IMPL_H
+#define BPT_IMPL_H
+
+/* definitions of the templates in bpt.h, only included from there */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+namespace bpt {
+
+template<class K, class V, size_t N, class C, class L>
+const size_t bplus_tree<K, V, N, C, L>::order;
+
+template<class K, class V, size_t N, class C, class L>
+const size_t bplus_tree<K, V, N, C, L>::block_size;
+
+template<class K, class V, size_t N, class C, class L>
+const off_t bplus_tree<K, V, N, C, L>::block_start;
+
+template<class K, class V, size_t N, class C, class L>
+const size_t bplus_tree<K, V, N, C, L>::header_size;
+
+/* holds the tree latch for a scope, nothing in single thread mode */
+template<class K, class V, size_t N, class C, class L>
+class bplus_tree<K, V, N, C, L>::tree_lock {
+public:
+    tree_lock(const bplus_tree &t, bool exclusive)
+        : tree(t), exclusive(exclusive)
+    {
+        if (tree.concurrent) {
+            if (exclusive) {
+                pthread_rwlock_wrlock(&tree.tree_latch);
+                tree.drain_readers();
+            } else {
+                pthread_rwlock_rdlock(&tree.tree_latch);
+            }
+        }
+    }
+
+    ~tree_lock()
+    {
+        if (tree.concurrent) {
+            if (exclusive)
+                __atomic_store_n(&tree.draining, 0, __ATOMIC_RELEASE);
+            pthread_rwlock_unlock(&tree.tree_latch);
+        }
+    }
+
+private:
+    const bplus_tree &tree;
+    bool exclusive;
+
+    tree_lock(const tree_lock &);
+    tree_lock &operator=(const tree_lock &);
+};
+
+/* a reader in progress, holds off the exclusive tree latch without
+ * touching anything other readers write, never nested in a thread */
+template<class K, class V, size_t N, class C, class L>
+class bplus_tree<K, V, N, C, L>::read_scope {
+public:
+    read_scope(const bplus_tree &t) : slot(NULL)
+    {
+        if (!t.concurrent)
+            return;
+
+        size_t h = (size_t)pthread_self() * 0x9e3779b97f4a7c15ULL;
+        slot = &t.readers[(h >> 32) % reader_slots].n;
+        for (;;) {
+            // pairs with drain_readers(), either it sees this reader or
+            // this reader sees it
+            __atomic_add_fetch(slot, 1, __ATOMIC_SEQ_CST);
+            if (!__atomic_load_n(&t.draining, __ATOMIC_SEQ_CST))
+                break;
+            __atomic_sub_fetch(slot, 1, __ATOMIC_RELEASE);
+            while (__atomic_load_n(&t.draining, __ATOMIC_ACQUIRE))
+                sched_yield();
+        }
+    }
+
+    ~read_scope()
+    {
+        if (slot != NULL)
+            __atomic_sub_fetch(slot, 1, __ATOMIC_RELEASE);
+    }
+
+private:
+    unsigned long *slot;
+
+    read_scope(const read_scope &);
+    read_scope &operator=(const read_scope &);
+};
+
+/* counts a write operation once it is done and out of the tree latch,
+ * so a commit can wait for the others to get out too */
+template<class K, class V, size_t N, class C, class L>
+class bplus_tree<K, V, N, C, L>::log_scope {
+public:
+    log_scope(bplus_tree &t) : tree(t)
+    {
+        tree.wal.begin();
+    }
+
+    ~log_scope()
+    {
+        tree.wal.end();
+        tree.commit();
+    }
+
+private:
+    bplus_tree &tree;
+
+    log_scope(const log_scope &);
+    log_scope &operator=(const log_scope &);
+};
+
+template<class K, class V, size_t N, class C, class L>
+bplus_tree<K, V, N, C, L>::bplus_tree(const char *p, bool force_empty,
+                                      size_t cache_size, int flags,
+                                      const options_t &o)
+    : pool(cache_size != 0 ? cache_size : o.cache_size, block_size),
+      concurrent(flags & BP_THREAD_SAFE), root_seq(0), options(o),
+      commit_ops(o.commit_ops), commit_ms(o.commit_ms),
+      pending(0), pending_since(0), flushing(false), closing(false),
+      in_transaction(false), snapshot_count(0), spill_fd(-1), spill_end(0),
+      cow(flags & BP_COW), shadow(block_size), structure_seq(0), base(NULL),
+      mapped(0), write_failed(false)
+{
+    bzero(node_versions, sizeof(node_versions));
+    bzero(readers, sizeof(readers));
+    draining = 0;
+    bzero(&meta, sizeof(meta));
+    bzero(&committed_meta, sizeof(committed_meta));
+    bzero(&last_commit, sizeof(last_commit));
+
+    // maintenance must not starve behind a stream of writers
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&tree_latch, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&pool_mutex, NULL);
+    pthread_mutex_init(&commit_mutex, NULL);
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&commit_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+    pthread_mutex_init(&snapshot_mutex, NULL);
+    pthread_cond_init(&snapshot_cond, NULL);
+
+    // alloc() is called both alone and while growing the root
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&meta_mutex, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    bzero(path, sizeof(path));
+    strcpy(path, p);
+
+    // every operation fails without the file, see good()
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        return;
+
+    // a commit never leaves the file half written, no log needed
+    if ((flags & BP_WAL) && !cow) {
+        char log[sizeof(path) + 8];
+        sprintf(log, "%s.wal", path);
+        if (wal.open(log) == 0) {
+            // finish or roll back what the last run left in the log
+            if (force_empty)
+                wal.reset();
+            else
+                wal.recover(fd);
+        }
+    }
+
+    if (!force_empty) {
+        // read tree from file
+        if (cow ? load_commit() != 0
+                : read_block(&meta, OFFSET_META, sizeof(meta)) != 0) {
+            force_empty = true;
+        } else if (!same_layout()) {
+            // nodes don't fit, leave the file alone, see good()
+            wal.close();
+            close(fd);
+            fd = -1;
+            bzero(&meta, sizeof(meta));
+            return;
+        }
+    }
+
+    if (force_empty)
+        ftruncate(fd, 0);
+
+    // the kernel would write mapped blocks back before the log, and
+    // blocks don't stay at one place in BP_COW mode
+    if ((flags & BP_MMAP) && !wal.enabled() && !cow) {
+        struct stat st;
+        fstat(fd, &st);
+        size_t size = st.st_size;
+        // keeps using the cache if the file can't be mapped
+        remap(size > (size_t)block_start ? size : block_start);
+    }
+
+    // create empty tree if file doesn't exist
+    if (force_empty) {
+        init_from_empty();
+        if (wal.enabled())
+            checkpoint();
+        if (cow)
+            commit_shadow();
+    }
+
+    // only the tree latch keeps a commit off the shadow blocks
+    if (wal.enabled() || (cow && concurrent))
+        flushing = pthread_create(&flusher, NULL, flush_loop, this) == 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+bplus_tree<K, V, N, C, L>::~bplus_tree()
+{
+    if (flushing) {
+        pthread_mutex_lock(&commit_mutex);
+        closing = true;
+        pthread_cond_signal(&commit_cond);
+        pthread_mutex_unlock(&commit_mutex);
+        pthread_join(flusher, NULL);
+    }
+
+    // like a crash in the middle of it
+    if (in_transaction)
+        abort_transaction();
+
+    if (good()) {
+        if (wal.enabled())
+            checkpoint();
+        else if (cow)
+            commit_shadow();
+        else
+            flush();
+        unmap_all();
+        close(fd);
+    }
+    if (spill_fd != -1)
+        close(spill_fd);
+
+    pthread_rwlock_destroy(&tree_latch);
+    pthread_mutex_destroy(&pool_mutex);
+    pthread_mutex_destroy(&meta_mutex);
+    pthread_mutex_destroy(&commit_mutex);
+    pthread_cond_destroy(&commit_cond);
+    pthread_mutex_destroy(&snapshot_mutex);
+    pthread_cond_destroy(&snapshot_cond);
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::search(const key_t& key, value_t *value) const
+{
+    if (!good())
+        return -1;
+
+    read_scope scope(*this);
+    unsigned long seq;
+    off_t offset = descend(&key, 0, NULL, &seq);
+    for (;;) {
+        unsigned long v = optimistic_begin(offset);
+        frame_t *frame;
+        leaf_node_t *leaf = view<leaf_node_t>(offset, &frame);
+
+        // finding the record, nothing is trusted before the version check
+        size_t n = std::min(leaf->n, record_array::capacity(leaf->children));
+        off_t next = beyond(leaf->high, key) ? leaf->next : 0;
+        int ret = -1;
+        value_t found = value_t();
+        record_iterator record = lower_bound(begin(*leaf), begin(*leaf) + n,
+                                             key);
+        if (record != begin(*leaf) + n) {
+            // always return the lower bound
+            found = record->value;
+
+            ret = keycmp(record->key, key);
+        }
+        release(frame);
+
+        if (!optimistic_valid(offset, v))
+            continue;
+        if (!structure_valid(seq)) {
+            // the leaf may have been merged away
+            offset = descend(&key, 0, NULL, &seq);
+            continue;
+        }
+        if (next != 0) {
+            offset = next;
+            continue;
+        }
+
+        if (ret != -1)
+            *value = found;
+        return ret;
+    }
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::scan_range(cursor &c, key_t *left,
+                                          const key_t &right, value_t *values,
+                                          size_t max, bool *next)
+{
+    if (left == NULL || keycmp(*left, right) > 0)
+        return -1;
+
+    size_t i = 0;
+    for (c.seek(*left); i < max && c.valid() && keycmp(c.key(), right) <= 0;
+         c.next())
+        values[i++] = c.value();
+
+    // mark for next iteration
+    if (next != NULL) {
+        if (c.valid() && keycmp(c.key(), right) <= 0) {
+            *next = true;
+            *left = c.key();
+        } else {
+            *next = false;
+        }
+    }
+
+    return i;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::search_range(key_t *left, const key_t &right,
+                                            value_t *values, size_t max,
+                                            bool *next) const
+{
+    if (!good())
+        return -1;
+
+    cursor c(*this);
+    return scan_range(c, left, right, values, max, next);
+}
+
+template<class K, class V, size_t N, class C, class L>
+bplus_tree<K, V, N, C, L>::cursor::cursor(const read_view &v)
+    : tree(v.tree), snap(v.snap), offset(0), pos(0), seq(0)
+{
+    leaf.n = 0;
+    leaf.next = leaf.prev = 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+bool bplus_tree<K, V, N, C, L>::cursor::seek(const key_t &key)
+{
+    if (!tree.good())
+        return false;
+
+    read_scope scope(tree);
+    locate(&key);
+    skip_empty();
+    return valid();
+}
+
+template<class K, class V, size_t N, class C, class L>
+bool bplus_tree<K, V, N, C, L>::cursor::seek_first()
+{
+    if (!tree.good())
+        return false;
+
+    read_scope scope(tree);
+    seq = tree.structure_begin();
+    load(snap != NULL ? snap->meta.leaf_offset : tree.meta.leaf_offset);
+    pos = 0;
+    skip_empty();
+    return valid();
+}
+
+template<class K, class V, size_t N, class C, class L>
+bool bplus_tree<K, V, N, C, L>::cursor::next()
+{
+    assert(valid());
+    ++pos;
+    if (pos < leaf.n)
+        return true;
+
+    read_scope scope(tree);
+    skip_empty();
+    return valid();
+}
+
+template<class K, class V, size_t N, class C, class L>
+bool bplus_tree<K, V, N, C, L>::cursor::seek_before(const key_t &key)
+{
+    seek(key);
+    return prev();
+}
+
+template<class K, class V, size_t N, class C, class L>
+bool bplus_tree<K, V, N, C, L>::cursor::seek_last()
+{
+    if (!tree.good())
+        return false;
+
+    {
+        read_scope scope(tree);
+        locate(NULL);
+    }
+    return prev();
+}
+
+template<class K, class V, size_t N, class C, class L>
+bool bplus_tree<K, V, N, C, L>::cursor::prev()
+{
+    // before the first record
+    if (pos == (size_t)-1)
+        return false;
+
+    // past the end of the last leaf keeps pos == leaf.n
+    if (pos > 0) {
+        --pos;
+        return true;
+    }
+
+    read_scope scope(tree);
+    while (pos == 0) {
+        if (leaf.prev == 0) {
+            pos = (size_t)-1;
+            return false;
+        }
+
+        // what comes before is less than the first key, or the high key
+        // of an empty leaf, look it up again if the links are stale
+        key_t bound = leaf.n > 0 ? leaf.children[0].key : leaf.high;
+        off_t from = offset;
+        if (!stale()) {
+            load(leaf.prev);
+
+            // the leaf before may have been split after it was linked
+            while (leaf.next != from && leaf.next != 0 && !stale())
+                load(leaf.next);
+        }
+        if (stale())
+            locate(bound ? &bound : NULL);
+        else
+            pos = leaf.n;
+    }
+
+    --pos;
+    return true;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::search_before(const key_t &key, key_t *keys,
+                                             value_t *values, size_t max) const
+{
+    if (!good())
+        return -1;
+
+    cursor c(*this);
+    size_t i = 0;
+    for (c.seek_before(key); i < max && c.valid(); c.prev(), ++i) {
+        if (keys != NULL)
+            keys[i] = c.key();
+        values[i] = c.value();
+    }
+
+    return i;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::cursor::locate(const key_t *key)
+{
+    do {
+        load(snap != NULL ? tree.descend(*snap, key)
+                          : tree.descend(key, 0, NULL, &seq));
+        while (leaf.next != 0 && (key == NULL || beyond(leaf.high, *key)) &&
+               !stale())
+            load(leaf.next);
+    } while (stale());
+    pos = key != NULL ? find(leaf, *key) - begin(leaf) : leaf.n;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::cursor::load(off_t o)
+{
+    offset = o;
+    if (snap != NULL)
+        tree.map(*snap, &leaf, offset);
+    else
+        tree.map_optimistic(&leaf, offset);
+}
+
+template<class K, class V, size_t N, class C, class L>
+bplus_tree<K, V, N, C, L>::read_view::read_view(const read_view &v)
+    : tree(v.tree), snap(v.snap)
+{
+    pthread_mutex_lock(&tree.snapshot_mutex);
+    ++snap->ref;
+    pthread_mutex_unlock(&tree.snapshot_mutex);
+}
+
+template<class K, class V, size_t N, class C, class L>
+bplus_tree<K, V, N, C, L>::read_view::~read_view()
+{
+    tree.drop_snapshot(snap);
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::read_view::search(const key_t &key,
+                                                 value_t *value) const
+{
+    cursor c(*this);
+    if (!c.seek(key))
+        return -1;
+
+    *value = c.value();
+    return keycmp(c.key(), key);
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::read_view::search_range(key_t *left,
+                                                       const key_t &right,
+                                                       value_t *values,
+                                                       size_t max,
+                                                       bool *next) const
+{
+    if (!tree.good())
+        return -1;
+
+    cursor c(*this);
+    return scan_range(c, left, right, values, max, next);
+}
+
+template<class K, class V, size_t N, class C, class L>
+typename bplus_tree<K, V, N, C, L>::read_view
+bplus_tree<K, V, N, C, L>::snapshot() const
+{
+    // nothing is half split or merged while writers are held off
+    tree_lock lock(*this, true);
+    snapshot_t *s = new snapshot_t;
+    s->meta = in_transaction ? committed_meta : meta;
+    s->ref = 1;
+
+    pthread_mutex_lock(&snapshot_mutex);
+    if (spill_fd == -1) {
+        // nobody else needs to see it, it goes away with the tree
+        char spill[sizeof(path) + 8];
+        sprintf(spill, "%s.snap", path);
+        spill_fd = open(spill, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (spill_fd != -1)
+            unlink(spill);
+    }
+    snapshots.push_back(s);
+    __atomic_store_n(&snapshot_count, snapshots.size(), __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&snapshot_mutex);
+    return read_view(*this, s);
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::drop_snapshot(snapshot_t *s) const
+{
+    pthread_mutex_lock(&snapshot_mutex);
+    if (--s->ref == 0) {
+        snapshots.erase(std::find(snapshots.begin(), snapshots.end(), s));
+        __atomic_store_n(&snapshot_count, snapshots.size(), __ATOMIC_RELEASE);
+        for (std::unordered_map<off_t, off_t>::iterator i = s->blocks.begin();
+             i != s->blocks.end(); ++i) {
+            if (--spill_refs[i->second] == 0) {
+                spill_refs.erase(i->second);
+                spill_free.push_back(i->second);
+            }
+        }
+        delete s;
+
+        if (snapshots.empty()) {
+            spill_free.clear();
+            spill_end = 0;
+            if (spill_fd != -1)
+                ftruncate(spill_fd, 0);
+            pthread_cond_broadcast(&snapshot_cond);
+        }
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+}
+
+template<class K, class V, size_t N, class C, class L>
+off_t bplus_tree<K, V, N, C, L>::spill(const char *block) const
+{
+    if (spill_fd == -1)
+        return -1;
+
+    off_t pos = spill_end;
+    if (!spill_free.empty()) {
+        pos = spill_free.back();
+        spill_free.pop_back();
+    } else {
+        spill_end += block_size;
+    }
+    if (pwrite(spill_fd, block, block_size, pos) != (ssize_t)block_size) {
+        spill_free.push_back(pos);
+        return -1;
+    }
+    return pos;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::preserve(off_t offset) const
+{
+    // meta and blocks added after a snapshot are none of its business
+    if (offset < block_start)
+        return;
+
+    pthread_mutex_lock(&snapshot_mutex);
+    char block[block_size];
+    bool read = false;
+    off_t pos = -1;
+    for (size_t i = 0; i < snapshots.size(); i++) {
+        snapshot_t *s = snapshots[i];
+        if (offset >= s->meta.slot || s->blocks.count(offset) > 0 ||
+            s->held.count(offset) > 0)
+            continue;
+
+        if (!read) {
+            read_whole(offset, block);
+            pos = spill(block);
+            read = true;
+        }
+
+        // kept in memory only if the spill file can't take it
+        if (pos >= 0) {
+            s->blocks[offset] = pos;
+            ++spill_refs[pos];
+        } else {
+            s->held[offset].assign(block, block + block_size);
+        }
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::read_whole(off_t offset, char *block) const
+{
+    bzero(block, block_size);
+    // mapped is published after base, so this size is within m
+    size_t size = __atomic_load_n(&mapped, __ATOMIC_ACQUIRE);
+    char *m = mapping();
+    if (m != NULL) {
+        memcpy(block, m + offset,
+               std::min((size_t)block_size, size - offset));
+        return;
+    }
+
+    // what is cached may be newer than the file, the rest is not
+    frame_t *frame = pin(offset, 0, false);
+    memcpy(block, frame->data, frame->size);
+    off_t at = physical(offset);
+    if (at >= 0 && frame->size < block_size)
+        pread(fd, block + frame->size, block_size - frame->size,
+              at + frame->size);
+    unpin(frame, false);
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::map(const snapshot_t &s, void *block,
+                                   off_t offset, size_t size) const
+{
+    for (;;) {
+        // the place in the spill file is free again once the snapshot is
+        // dropped, not while it is read
+        int ret = 0;
+        pthread_mutex_lock(&snapshot_mutex);
+        std::unordered_map<off_t, off_t>::const_iterator i =
+            s.blocks.find(offset);
+        std::unordered_map<off_t, std::vector<char> >::const_iterator h =
+            s.held.find(offset);
+        bool saved = i != s.blocks.end() || h != s.held.end();
+        if (i != s.blocks.end()) {
+            if (pread(spill_fd, block, size, i->second) != (ssize_t)size)
+                ret = -1;
+        } else if (h != s.held.end()) {
+            memcpy(block, &h->second[0], size);
+        }
+        pthread_mutex_unlock(&snapshot_mutex);
+        if (saved)
+            return ret;
+
+        // a writer saves the block before it changes it, so the block
+        // read is still the old one if it is not saved afterwards either
+        ret = fetch(block, offset, size);
+        pthread_mutex_lock(&snapshot_mutex);
+        saved = s.blocks.count(offset) > 0 || s.held.count(offset) > 0;
+        pthread_mutex_unlock(&snapshot_mutex);
+        if (!saved)
+            return ret;
+    }
+}
+
+template<class K, class V, size_t N, class C, class L>
+off_t bplus_tree<K, V, N, C, L>::descend(const snapshot_t &s,
+                                         const key_t *key) const
+{
+    off_t org = s.meta.root_offset;
+    for (size_t height = s.meta.height; height > 0; --height) {
+        internal_node_t node;
+        map(s, &node, org);
+        index_iterator i = key != NULL
+                           ? upper_bound(begin(node), end(node) - 1, *key)
+                           : end(node) - 1;
+        org = i->child;
+    }
+    return org;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::cursor::skip_empty()
+{
+    // move to the next leaf once this one is done, what is left is not
+    // less than the high key if the link is stale
+    while (pos >= leaf.n && leaf.next != 0) {
+        key_t high = leaf.high;
+        if (!stale())
+            load(leaf.next);
+        if (stale())
+            locate(&high);
+        else
+            pos = 0;
+    }
+}
+
+template<class K, class V, size_t N, class C, class L>
+bplus_tree<K, V, N, C, L>::bulk_loader::bulk_loader(bplus_tree &t, double f)
+    : tree(t), fill(f), has_prev(false), count(0)
+{
+    assert(fill > 0 && fill <= 1);
+    if (!tree.good())
+        return;
+
+    // start from an empty file, the log is about the old one
+    tree.pool.clear();
+    if (tree.wal.enabled())
+        tree.wal.reset();
+    if (tree.cow) {
+        tree.shadow.reset();
+        bzero(&tree.last_commit, sizeof(commit_t));
+    }
+    ftruncate(tree.fd, 0);
+    tree.empty_meta();
+
+    leaf.next = leaf.prev = 0;
+    leaf_off = tree.alloc(&leaf);
+    tree.meta.leaf_offset = leaf_off;
+}
+
+template<class K, class V, size_t N, class C, class L>
+size_t bplus_tree<K, V, N, C, L>::bulk_loader::per_node(size_t room) const
+{
+    // a split node must still be at least half full
+    size_t n = room * fill;
+    if (n < tree.meta.order / 2 + 1)
+        n = tree.meta.order / 2 + 1;
+    if (n > room)
+        n = room;
+    return n;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::bulk_loader::add(const key_t &key, value_t value)
+{
+    if (!tree.good() || !key || (count > 0 && keycmp(last, key) >= 0))
+        return -1;
+    last = key;
+    ++count;
+
+    // keys sharing a prefix may take less room
+    if (leaf.n >= per_node(record_array::capacity(leaf.children)))
+        record_array::pack(leaf.children, leaf.n);
+    if (leaf.n >= per_node(record_array::capacity(leaf.children)) ||
+        !record_array::make_room(leaf.children, leaf.n, key)) {
+        if (has_prev)
+            write_leaf(prev, prev_off, leaf_off, begin(leaf)->key);
+
+        prev = leaf;
+        prev_off = leaf_off;
+        has_prev = true;
+
+        leaf.prev = prev_off;
+        leaf.next = 0;
+        leaf_off = tree.alloc(&leaf);
+    }
+
+    leaf.children[leaf.n].key = key;
+    leaf.children[leaf.n].value = value;
+    leaf.n++;
+    return 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::bulk_loader::finish()
+{
+    if (!tree.good())
+        return;
+
+    if (has_prev) {
+        // keep the last leaf at least half full
+        size_t min_n = tree.meta.order / 2;
+        if (leaf.n < min_n) {
+            size_t total = prev.n + leaf.n;
+            std::vector<record_t> records(begin(prev), end(prev));
+            records.insert(records.end(), begin(leaf), end(leaf));
+
+            // split evenly if one leaf can't hold all, unless the right
+            // part doesn't fit then
+            size_t point = total;
+            if (record_array::reshape(prev.children, records.begin(),
+                                      records.end()) < total) {
+                point = total / 2;
+                if (record_array::reshape(leaf.children,
+                                          records.begin() + point,
+                                          records.end()) < total - point)
+                    point = total - tree.meta.order;
+                record_array::reshape(prev.children, records.begin(),
+                                      records.begin() + point);
+            }
+            record_array::reshape(leaf.children, records.begin() + point,
+                                  records.end());
+
+            std::copy(records.begin(), records.begin() + point, begin(prev));
+            prev.n = point;
+            std::copy(records.begin() + point, records.end(), begin(leaf));
+            leaf.n = total - point;
+        }
+
+        if (leaf.n == 0) {
+            // the last leaf is merged, it is still at the end of file
+            tree.meta.leaf_node_num--;
+            tree.meta.slot -= block_size;
+            write_leaf(prev, prev_off, 0, key_t());
+        } else {
+            write_leaf(prev, prev_off, leaf_off, begin(leaf)->key);
+            write_leaf(leaf, leaf_off, 0, key_t());
+        }
+    } else {
+        write_leaf(leaf, leaf_off, 0, key_t());
+    }
+
+    // every pass builds one internal level, stop after the root
+    do {
+        build_level();
+    } while (level.size() > 1);
+
+    tree.meta.root_offset = level[0].child;
+    tree.save_meta();
+
+    // nothing above is logged
+    if (tree.wal.enabled())
+        tree.checkpoint();
+    if (tree.cow)
+        tree.commit_shadow();
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::bulk_loader::write_leaf(leaf_node_t &node,
+                                                        off_t offset,
+                                                        off_t next,
+                                                        const key_t &high)
+{
+    node.next = next;
+    node.high = high;
+    record_array::pack(node.children, node.n);
+    tree.unmap(&node, offset);
+
+    index_t index;
+    index.key = node.n > 0 ? begin(node)->key : key_t();
+    index.child = offset;
+    level.push_back(index);
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::bulk_loader::build_level()
+{
+    // separators are the first keys of the right siblings, the last one
+    // is the first key of the next node like after a split
+    size_t count = level.size();
+    std::vector<index_t> entries(count);
+    for (size_t i = 0; i < count; i++) {
+        entries[i].child = level[i].child;
+        entries[i].key = i + 1 < count ? level[i + 1].key : key_t();
+    }
+
+    std::vector<index_t> upper;
+    off_t first = tree.meta.slot;
+    size_t nodes = 0;
+    size_t i = 0;
+    while (i < count) {
+        internal_node_t node;
+        off_t offset = tree.alloc(&node);
+        node.prev = i == 0 ? 0 : offset - block_size;
+
+        // keys sharing a prefix may take more children, and what is left
+        // after the node must be at least half full or go in with it
+        typename std::vector<index_t>::iterator from = entries.begin() + i;
+        size_t left = count - i;
+        size_t n = std::min(left, per_node(tree.meta.order));
+        size_t more = std::min(left, per_node(
+                index_array::reshape(node.children, from, from + n)));
+        if (more > n &&
+            index_array::reshape(node.children, from, from + more) >= more)
+            n = more;
+        if (n < left && left - n < tree.meta.order / 2)
+            n = left <= tree.meta.order ? left : left / 2;
+        index_array::reshape(node.children, from, from + n);
+
+        node.n = n;
+        node.next = i + n == count ? 0 : offset + block_size;
+        for (size_t j = 0; j < n; j++)
+            node.children[j] = entries[i + j];
+        tree.unmap(&node, offset);
+
+        index_t index;
+        index.key = level[i].key;
+        index.child = offset;
+        upper.push_back(index);
+        i += n;
+        ++nodes;
+    }
+
+    assert(first + (off_t)(nodes * block_size) == tree.meta.slot);
+    level.swap(upper);
+    tree.meta.height++;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::compact()
+{
+    if (!good())
+        return -1;
+
+    char tmp[sizeof(path) + 16];
+    sprintf(tmp, "%s.compact", path);
+
+    // snapshots still read the old file, a new one can't be taken once
+    // the tree latch is held
+    for (;;) {
+        pthread_mutex_lock(&snapshot_mutex);
+        while (!snapshots.empty())
+            pthread_cond_wait(&snapshot_cond, &snapshot_mutex);
+        pthread_mutex_unlock(&snapshot_mutex);
+
+        tree_lock lock(*this, true);
+        if (__atomic_load_n(&snapshot_count, __ATOMIC_ACQUIRE) == 0)
+            return compact_latched(tmp);
+    }
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::compact_latched(const char *tmp)
+{
+    // the transaction isn't in the file yet
+    if (in_transaction)
+        return -1;
+
+    // the log must not outlive the file it is about
+    if (wal.enabled())
+        checkpoint();
+    {
+        bplus_tree target(tmp, true, pool.capacity, cow ? BP_COW : 0,
+                          options);
+        bulk_loader loader(target, 1.0);
+
+        off_t offset = meta.leaf_offset;
+        while (offset != 0) {
+            frame_t *frame;
+            leaf_node_t *leaf = view<leaf_node_t>(offset, &frame);
+            for (record_iterator r = begin(*leaf); r != end(*leaf); ++r)
+                loader.add(r->key, r->value);
+            offset = leaf->next;
+            release(frame);
+        }
+        loader.finish();
+    }
+
+    if (wal.enabled()) {
+        int tfd = open(tmp, O_RDONLY);
+        fsync(tfd);
+        close(tfd);
+    }
+    if (rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    reopen();
+    return 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::drain_readers() const
+{
+    __atomic_store_n(&draining, 1, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < reader_slots; i++)
+        while (__atomic_load_n(&readers[i].n, __ATOMIC_SEQ_CST) != 0)
+            sched_yield();
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::reopen()
+{
+    // cursors hold leaves of the old file
+    structure_lock();
+
+    // cached blocks belong to the old file
+    pool.clear();
+    bool mmaped = base != NULL;
+    unmap_all();
+    close(fd);
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cow)
+        load_commit();
+    else
+        read_block(&meta, OFFSET_META, sizeof(meta));
+    if (mmaped)
+        remap(meta.slot);
+    structure_unlock();
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::search_many(const key_t *keys, value_t *values,
+                                           int *status, size_t n) const
+{
+    if (!good())
+        return -1;
+
+    read_scope scope(*this);
+
+    // visit keys in order, so neighbouring keys share the same path
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), key_index_less(keys));
+
+    // the path from root, a node is left once a key reaches its high key
+    unsigned long seq = structure_begin();
+    off_t root_off;
+    size_t height;
+    root(&root_off, &height);
+    std::vector<internal_node_t> path(height);
+    size_t depth = 0;
+    leaf_node_t leaf;
+    bool has_leaf = false;
+
+    int found = 0;
+    for (size_t k = 0; k < n; k++) {
+        const key_t &key = keys[order[k]];
+
+        if (!structure_valid(seq)) {
+            // nodes on the path may be gone, start from the root again
+            seq = structure_begin();
+            root(&root_off, &height);
+            path.resize(height);
+            depth = 0;
+            has_leaf = false;
+        }
+
+        if (!has_leaf || beyond(leaf.high, key)) {
+            // go up until the key is inside the subtree
+            while (depth > 1 && beyond(high_key(path[depth - 1]), key))
+                --depth;
+
+            if (depth == 0) {
+                map_optimistic(&path[0], root_off);
+                depth = 1;
+            }
+
+            // and down again, right past splits the parent doesn't know
+            for (;;) {
+                internal_node_t &node = path[depth - 1];
+                if (!structure_valid(seq))
+                    break;
+                if (node.next != 0 && beyond(high_key(node), key)) {
+                    map_optimistic(&node, node.next);
+                    continue;
+                }
+
+                index_iterator i = upper_bound(begin(node), end(node) - 1, key);
+                if (depth == height) {
+                    map_optimistic(&leaf, i->child);
+                    while (leaf.next != 0 && beyond(leaf.high, key) &&
+                           structure_valid(seq))
+                        map_optimistic(&leaf, leaf.next);
+                    has_leaf = true;
+                    break;
+                }
+                map_optimistic(&path[depth], i->child);
+                ++depth;
+            }
+            if (!structure_valid(seq)) {
+                --k;
+                continue;
+            }
+        }
+
+        // same as search()
+        status[order[k]] = -1;
+        record_iterator record = find(leaf, key);
+        if (record != end(leaf)) {
+            values[order[k]] = record->value;
+            status[order[k]] = keycmp(record->key, key);
+            if (status[order[k]] == 0)
+                ++found;
+        }
+    }
+
+    return found;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::remove(const key_t& key)
+{
+    if (!good())
+        return -1;
+
+    log_scope scope(*this);
+    tree_lock lock(*this, false);
+    {
+        // most removes only change one leaf
+        latch_t *latch;
+        off_t offset = latch_leaf(&key, &latch);
+        leaf_node_t leaf;
+        map(&leaf, offset);
+
+        // no siblings means this is the only leaf
+        int ret = 1;
+        size_t min_n = leaf.prev == 0 && leaf.next == 0 ? 0 : meta.order / 2;
+        record_iterator to_delete = find(leaf, key);
+        if (to_delete == end(leaf) || keycmp(to_delete->key, key) != 0) {
+            ret = -1;
+        } else if (leaf.n > min_n) {
+            std::copy(to_delete + 1, end(leaf), to_delete);
+            leaf.n--;
+            unmap(&leaf, offset);
+            ret = 0;
+        }
+        unlatch(latch);
+        if (ret != 1)
+            return ret;
+    }
+
+    // the leaf underflows, borrow or merge
+    for (;;) {
+        int ret = remove_latched(key);
+        if (ret != 1)
+            return ret;
+        sched_yield();
+    }
+}
+
+template<class K, class V, size_t N, class C, class L>
+template<class T>
+bool bplus_tree<K, V, N, C, L>::latch_family(internal_node_t &parent,
+                                             const key_t &key, T *nodes,
+                                             off_t *offsets,
+                                             latch_t **held) const
+{
+    index_iterator where = find(parent, key);
+    size_t i = where - begin(parent);
+    for (int k = 0; k < 3; k++) {
+        offsets[k] = 0;
+        held[k] = NULL;
+    }
+
+    for (int k = 0; k < 3; k++) {
+        if ((k == 0 && i == 0) || (k == 2 && i + 1 == parent.n))
+            continue;
+
+        // the key after a child in its parent is its high key
+        index_iterator c = where + (k - 1);
+        offsets[k] = c->child;
+        held[k] = latch(offsets[k], true);
+        map(&nodes[k], offsets[k]);
+        if (!same_key(high_key(nodes[k]), c->key))
+            return false;
+    }
+    return true;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::remove_latched(const key_t &key)
+{
+    // latches in the order taken, every level left to right, and the
+    // nodes from the lowest one that keeps enough children down
+    std::vector<latch_t *> held;
+    std::vector<off_t> path;
+
+    off_t offset;
+    size_t height;
+    root(&offset, &height);
+    held.push_back(latch(offset, true));
+    internal_node_t node;
+    map(&node, offset);
+
+    // split or replaced since root() was read
+    int ret = 1;
+    if (node.next != 0 ||
+        __atomic_load_n(&meta.root_offset, __ATOMIC_ACQUIRE) != offset)
+        goto out;
+    path.push_back(offset);
+
+    for (size_t level = height; level > 1; --level) {
+        internal_node_t nodes[3];
+        off_t offsets[3];
+        latch_t *family[3];
+        bool ok = latch_family(node, key, nodes, offsets, family);
+        held.insert(held.end(), family, family + 3);
+        if (!ok)
+            goto out;
+
+        if (nodes[1].n > meta.order / 2) {
+            // it can lose a child, nothing above it changes
+            for (size_t i = 0; i < held.size(); i++)
+                if (held[i] != family[1])
+                    unlatch(held[i]);
+            held.assign(1, family[1]);
+            path.clear();
+        } else {
+            // the node after the one a merge removes points back to it
+            off_t after = offsets[2] != 0 ? nodes[2].next : nodes[1].next;
+            if (after != 0)
+                held.push_back(latch(after, true));
+        }
+        path.push_back(offsets[1]);
+        node = nodes[1];
+    }
+
+    {
+        leaf_node_t leaves[3];
+        off_t offsets[3];
+        latch_t *family[3];
+        bool ok = latch_family(node, key, leaves, offsets, family);
+        held.insert(held.end(), family, family + 3);
+        if (!ok)
+            goto out;
+
+        leaf_node_t &leaf = leaves[1];
+        ret = -1;
+        if (!contains(leaf, key))
+            goto out;
+
+        // no siblings means this is the only leaf
+        size_t min_n = leaf.prev == 0 && leaf.next == 0 ? 0 : meta.order / 2;
+        assert(leaf.n >= min_n &&
+               leaf.n <= record_array::capacity(leaf.children));
+        record_iterator to_delete = find(leaf, key);
+        std::copy(to_delete + 1, end(leaf), to_delete);
+        leaf.n--;
+        ret = 0;
+        if (leaf.n >= min_n) {
+            // an insert made room since
+            unmap(&leaf, offsets[1]);
+            goto out;
+        }
+
+        off_t after = offsets[2] != 0 ? leaves[2].next : leaf.next;
+        if (after != 0)
+            held.push_back(latch(after, true));
+
+        // readers check that no keys moved left under them
+        structure_lock();
+
+        // first borrow from left, then from right
+        bool borrowed = false;
+        if (offsets[0] != 0)
+            borrowed = borrow_key(false, leaf, path);
+        if (!borrowed && offsets[2] != 0)
+            borrowed = borrow_key(true, leaf, path);
+
+        // finally we merge
+        if (!borrowed) {
+            assert(offsets[0] != 0 || offsets[2] != 0);
+
+            internal_node_t parent;
+            off_t parent_off = path.back();
+            map(&parent, parent_off);
+
+            key_t index_key;
+            if (offsets[2] == 0) {
+                // if leaf is last element then merge | prev | leaf |
+                leaf_node_t &prev = leaves[0];
+                index_key = begin(prev)->key;
+
+                merge_leafs(&prev, &leaf);
+                node_remove(&prev, &leaf);
+                unmap(&prev, offsets[0]);
+            } else {
+                // else merge | leaf | next |
+                leaf_node_t &next = leaves[2];
+                index_key = begin(leaf)->key;
+
+                merge_leafs(&leaf, &next);
+                node_remove(&leaf, &next);
+                unmap(&leaf, offsets[1]);
+            }
+
+            // remove parent's key
+            path.pop_back();
+            remove_from_index(path, parent_off, parent, index_key);
+        } else {
+            unmap(&leaf, offsets[1]);
+        }
+        structure_unlock();
+    }
+
+out:
+    for (size_t i = held.size(); i > 0; --i)
+        unlatch(held[i - 1]);
+    return ret;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::insert(const key_t& key, value_t value)
+{
+    if (!good() || !key)
+        return -1;
+
+    log_scope scope(*this);
+    tree_lock lock(*this, false);
+    std::vector<off_t> path;
+    unsigned long seq;
+    latch_t *latch;
+    off_t offset = latch_leaf(&key, &latch, &path, &seq);
+    leaf_node_t leaf;
+    map(&leaf, offset);
+
+    // check if we have the same key
+    if (contains(leaf, key)) {
+        unlatch(latch);
+        return 1;
+    }
+
+    if (record_array::make_room(leaf.children, leaf.n, key)) {
+        insert_record_no_split(&leaf, key, value);
+        unmap(&leaf, offset);
+        unlatch(latch);
+        return 0;
+    }
+
+    // split when full
+
+    // new sibling leaf
+    leaf_node_t new_leaf;
+    node_create(offset, &leaf, &new_leaf);
+
+    // find even split point
+    size_t point = leaf.n / 2;
+    bool place_right = keycmp(key, leaf.children[point].key) > 0;
+    if (place_right)
+        ++point;
+
+    // split
+    std::copy(begin(leaf) + point, end(leaf), begin(new_leaf));
+    new_leaf.n = leaf.n - point;
+    leaf.n = point;
+
+    // which part do we put the key
+    if (place_right)
+        insert_record_no_split(&new_leaf, key, value);
+    else
+        insert_record_no_split(&leaf, key, value);
+
+    new_leaf.high = leaf.high;
+    leaf.high = begin(new_leaf)->key;
+
+    // save leafs, the new one is reachable once leaf is saved
+    unmap(&new_leaf, leaf.next);
+    unmap(&leaf, offset);
+    set_prev(&new_leaf, new_leaf.next, leaf.next);
+    unlatch(latch);
+
+    // insert new index key
+    insert_key_to_index(path, seq, 0, begin(new_leaf)->key,
+                        offset, leaf.next);
+    return 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::insert_batch(const record_t *records, size_t n)
+{
+    if (!good())
+        return -1;
+    for (size_t i = 0; i < n; i++)
+        if (!records[i].key)
+            return -1;
+
+    log_scope scope(*this);
+    tree_lock lock(*this, true);
+
+    std::vector<record_t> batch(records, records + n);
+    std::stable_sort(batch.begin(), batch.end(), record_less);
+
+    int inserted = 0;
+    std::vector<record_t> merged;
+    size_t i = 0;
+    while (i < n) {
+        // one descent for all keys that belong to this leaf
+        std::vector<off_t> path;
+        unsigned long seq;
+        off_t offset = descend(&batch[i].key, 0, &path, &seq);
+        leaf_node_t leaf;
+        map(&leaf, offset);
+
+        merged.clear();
+        record_iterator r = begin(leaf);
+        for (; i < n && !beyond(leaf.high, batch[i].key); ++i) {
+            const key_t &key = batch[i].key;
+            for (; r != end(leaf) && keycmp(r->key, key) < 0; ++r)
+                merged.push_back(*r);
+
+            // like insert(), existing keys and repeated keys are skipped
+            if (r != end(leaf) && keycmp(r->key, key) == 0)
+                continue;
+            if (i > 0 && keycmp(batch[i - 1].key, key) == 0)
+                continue;
+            merged.push_back(batch[i]);
+            ++inserted;
+        }
+        merged.insert(merged.end(), r, end(leaf));
+
+        // split once into as many even leaves as needed
+        size_t total = merged.size();
+        size_t room = record_array::reshape(leaf.children, merged.begin(),
+                                            merged.end());
+        size_t pieces = total <= room ? 1
+                                      : (total + meta.order - 1) / meta.order;
+        size_t point = total / pieces + (0 < total % pieces ? 1 : 0);
+        record_array::reshape(leaf.children, merged.begin(),
+                              merged.begin() + point);
+        std::copy(merged.begin(), merged.begin() + point, begin(leaf));
+        leaf.n = point;
+
+        for (size_t p = 1; p < pieces; p++) {
+            leaf_node_t new_leaf;
+            node_create(offset, &leaf, &new_leaf);
+
+            size_t count = total / pieces + (p < total % pieces ? 1 : 0);
+            record_array::reshape(new_leaf.children, merged.begin() + point,
+                                  merged.begin() + point + count);
+            std::copy(merged.begin() + point, merged.begin() + point + count,
+                      begin(new_leaf));
+            new_leaf.n = count;
+            point += count;
+            new_leaf.high = leaf.high;
+            leaf.high = begin(new_leaf)->key;
+
+            unmap(&new_leaf, leaf.next);
+            unmap(&leaf, offset);
+            set_prev(&new_leaf, new_leaf.next, leaf.next);
+            insert_key_to_index(path, seq, 0, begin(new_leaf)->key,
+                                offset, leaf.next);
+
+            // a split of the parent may have moved the new leaf
+            offset = leaf.next;
+            leaf = new_leaf;
+            map(&leaf, offset, header_size);
+        }
+        unmap(&leaf, offset);
+    }
+
+    return inserted;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::update(const key_t& key, value_t value)
+{
+    if (!good())
+        return -1;
+
+    log_scope scope(*this);
+    tree_lock lock(*this, false);
+    latch_t *latch;
+    off_t offset = latch_leaf(&key, &latch);
+    leaf_node_t leaf;
+    map(&leaf, offset);
+
+    int ret = -1;
+    record_iterator record = find(leaf, key);
+    if (record != leaf.children + leaf.n) {
+        if (keycmp(key, record->key) == 0) {
+            record->value = value;
+            unmap(&leaf, offset);
+
+            ret = 0;
+        } else {
+            ret = 1;
+        }
+    }
+
+    unlatch(latch);
+    return ret;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::remove_from_index(std::vector<off_t> path,
+                                                  off_t offset,
+                                                  internal_node_t &node,
+                                                  const key_t &key)
+{
+    // the root can't change while it is latched
+    bool is_root = __atomic_load_n(&meta.root_offset, __ATOMIC_ACQUIRE) ==
+                   offset;
+    size_t min_n = is_root ? 1 : meta.order / 2;
+    assert(node.n >= min_n &&
+           node.n <= index_array::capacity(node.children));
+
+    // remove key
+    index_iterator to_delete = find(node, key);
+    if (to_delete + 1 < end(node)) {
+        (to_delete + 1)->child = to_delete->child;
+        std::copy(to_delete + 1, end(node), to_delete);
+    }
+    node.n--;
+
+    // remove to only one key, which is not a leaf
+    if (node.n == 1 && is_root && meta.height > 1) {
+        lock_meta();
+        unalloc(&node, offset);
+        set_root(node.children[0].child, meta.height - 1);
+        save_meta();
+        unlock_meta();
+        return;
+    }
+
+    // merge or borrow
+    if (node.n < min_n) {
+        off_t parent_off = path.back();
+        path.pop_back();
+        internal_node_t parent;
+        map(&parent, parent_off);
+
+        // first borrow from left
+        bool borrowed = false;
+        if (offset != begin(parent)->child)
+            borrowed = borrow_key(false, node, parent_off);
+
+        // then borrow from right
+        if (!borrowed && offset != (end(parent) - 1)->child)
+            borrowed = borrow_key(true, node, parent_off);
+
+        // finally we merge
+        if (!borrowed) {
+            assert(node.next != 0 || node.prev != 0);
+
+            if (offset == (end(parent) - 1)->child) {
+                // if leaf is last element then merge | prev | leaf |
+                assert(node.prev != 0);
+                internal_node_t prev;
+                map(&prev, node.prev);
+
+                // merge
+                index_iterator where = find(parent, begin(prev)->key);
+                merge_keys(where, prev, node, true);
+                unmap(&prev, node.prev);
+            } else {
+                // else merge | leaf | next |
+                assert(node.next != 0);
+                internal_node_t next;
+                map(&next, node.next);
+
+                // merge
+                index_iterator where = find(parent, key);
+                merge_keys(where, node, next);
+                unmap(&node, offset);
+            }
+
+            // remove parent's key, the first key of node may already be
+            // the high key after a merge below, but `key` is still inside
+            remove_from_index(path, parent_off, parent, key);
+        } else {
+            unmap(&node, offset);
+        }
+    } else {
+        unmap(&node, offset);
+    }
+}
+
+template<class K, class V, size_t N, class C, class L>
+bool bplus_tree<K, V, N, C, L>::borrow_key(bool from_right,
+                                           internal_node_t &borrower,
+                                           off_t parent_off)
+{
+    off_t lender_off = from_right ? borrower.next : borrower.prev;
+    internal_node_t lender;
+    map(&lender, lender_off);
+
+    assert(lender.n >= meta.order / 2);
+    if (lender.n != meta.order / 2) {
+        index_iterator where_to_lend, where_to_put;
+
+        internal_node_t parent;
+        map(&parent, parent_off);
+
+        // swap keys, draw on paper to see why
+        if (from_right) {
+            where_to_lend = begin(lender);
+            where_to_put = end(borrower);
+
+            index_iterator where = lower_bound(begin(parent), end(parent) - 1,
+                                        (end(borrower) -1)->key);
+            index_array::take_key(parent.children, parent.n,
+                                  where_to_lend->key);
+            where->key = where_to_lend->key;
+        } else {
+            where_to_lend = end(lender) - 1;
+            where_to_put = begin(borrower);
+
+            // a parent of stripped keys may not take the new first one
+            index_iterator where = find(parent, begin(lender)->key);
+            if (!index_array::take_key(parent.children, parent.n,
+                                       (where_to_lend - 1)->key))
+                return false;
+            // where_to_put->key = where->key;  // We shouldn't change where_to_put->key, because it just records the largest info but we only changes a new one which have been the smallest one
+            where->key = (where_to_lend - 1)->key;
+        }
+        unmap(&parent, parent_off);
+
+        // store
+        index_array::make_room(borrower.children, borrower.n,
+                               where_to_lend->key);
+        std::copy_backward(where_to_put, end(borrower), end(borrower) + 1);
+        *where_to_put = *where_to_lend;
+        borrower.n++;
+
+        // erase
+        std::copy(where_to_lend + 1, end(lender), where_to_lend);
+        lender.n--;
+        unmap(&lender, lender_off);
+        return true;
+    }
+
+    return false;
+}
+
+template<class K, class V, size_t N, class C, class L>
+bool bplus_tree<K, V, N, C, L>::borrow_key(bool from_right,
+                                           leaf_node_t &borrower,
+                                           const std::vector<off_t> &path)
+{
+    off_t lender_off = from_right ? borrower.next : borrower.prev;
+    leaf_node_t lender;
+    map(&lender, lender_off);
+
+    assert(lender.n >= meta.order / 2);
+    if (lender.n != meta.order / 2) {
+        record_iterator where_to_lend, where_to_put;
+
+        // decide offset and update parent's index key
+        if (from_right) {
+            where_to_lend = begin(lender);
+            where_to_put = end(borrower);
+            change_parent_child(path, begin(borrower)->key,
+                                lender.children[1].key);
+            borrower.high = lender.children[1].key;
+        } else {
+            where_to_lend = end(lender) - 1;
+            where_to_put = begin(borrower);
+            // a parent of stripped keys may not take the new first one
+            if (!change_parent_child(path, begin(lender)->key,
+                                     where_to_lend->key))
+                return false;
+            lender.high = where_to_lend->key;
+        }
+
+        // store
+        record_array::make_room(borrower.children, borrower.n,
+                                where_to_lend->key);
+        std::copy_backward(where_to_put, end(borrower), end(borrower) + 1);
+        *where_to_put = *where_to_lend;
+        borrower.n++;
+
+        // erase
+        std::copy(where_to_lend + 1, end(lender), where_to_lend);
+        lender.n--;
+        unmap(&lender, lender_off);
+        return true;
+    }
+
+    return false;
+}
+
+template<class K, class V, size_t N, class C, class L>
+bool bplus_tree<K, V, N, C, L>::change_parent_child(std::vector<off_t> path,
+                                                    const key_t &o,
+                                                    const key_t &n)
+{
+    bool first = true;
+    while (!path.empty()) {
+        off_t parent = path.back();
+        path.pop_back();
+
+        internal_node_t node;
+        map(&node, parent);
+
+        index_iterator w = find(node, o);
+        assert(w != node.children + node.n);
+
+        if (!index_array::take_key(node.children, node.n, n)) {
+            assert(first);
+            return false;
+        }
+        w->key = n;
+        unmap(&node, parent);
+        if (w != node.children + node.n - 1)
+            return true;
+        first = false;
+    }
+    return true;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::merge_leafs(leaf_node_t *left,
+                                            leaf_node_t *right)
+{
+    // both are at most half full
+    record_array::unpack(left->children, left->n);
+    std::copy(begin(*right), end(*right), end(*left));
+    left->n += right->n;
+    left->high = right->high;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::merge_keys(index_iterator where,
+                                           internal_node_t &node,
+                                           internal_node_t &next,
+                                           bool change_where_key)
+{
+    //(end(node) - 1)->key = where->key;
+    if (change_where_key) {
+        where->key = (end(next) - 1)->key;
+    }
+
+    // both are at most half full
+    index_array::unpack(node.children, node.n);
+    std::copy(begin(next), end(next), end(node));
+    node.n += next.n;
+    node_remove(&node, &next);
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::insert_record_no_split(leaf_node_t *leaf,
+                                                       const key_t &key,
+                                                       const value_t &value)
+{
+    record_array::make_room(leaf->children, leaf->n, key);
+    record_iterator where = upper_bound(begin(*leaf), end(*leaf), key);
+    std::copy_backward(where, end(*leaf), end(*leaf) + 1);
+
+    where->key = key;
+    where->value = value;
+    leaf->n++;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::insert_key_to_index(std::vector<off_t> path,
+                                                    unsigned long seq,
+                                                    size_t level, key_t key,
+                                                    off_t old, off_t after)
+{
+    for (;;) {
+        off_t offset;
+        if (!path.empty()) {
+            offset = path.back();
+            path.pop_back();
+        } else if (grow_root(level, key, old, after)) {
+            return;
+        } else {
+            // the tree has grown above `old` since we came down
+            offset = descend(&key, level + 1, &path, &seq);
+            if (offset == 0) {
+                // another split is putting the new root in place
+                sched_yield();
+                continue;
+            }
+        }
+
+        latch_t *held = latch(offset, true);
+        internal_node_t node;
+        map(&node, offset);
+
+        // a merge may have taken the node away since we came down
+        if (!structure_valid(seq)) {
+            unlatch(held);
+            path.clear();
+            offset = descend(&key, level + 1, &path, &seq);
+            if (offset == 0) {
+                sched_yield();
+                continue;
+            }
+            path.push_back(offset);
+            continue;
+        }
+
+        // the node may have been split after we passed it
+        while (node.next != 0 && beyond(high_key(node), key)) {
+            latch_t *next = latch(node.next, true);
+            unlatch(held);
+            held = next;
+            offset = node.next;
+            map(&node, offset);
+        }
+        if (index_array::make_room(node.children, node.n, key)) {
+            insert_key_to_index_no_split(node, key, after);
+            unmap(&node, offset);
+            unlatch(held);
+            return;
+        }
+
+        // split when full
+
+        internal_node_t new_node;
+        node_create(offset, &node, &new_node);
+        latch_t *new_latch = latch(node.next, true);
+
+        // find even split point
+        size_t point = (node.n - 1) / 2;
+        bool place_right = keycmp(key, node.children[point].key) > 0;
+        if (place_right)
+            ++point;
+
+        // prevent the `key` being the right `middle_key`
+        // example: insert 48 into |42|45| 6|  |
+        if (place_right && keycmp(key, node.children[point].key) < 0)
+            point--;
+
+        key_t middle_key = node.children[point].key;
+
+        // split
+        std::copy(begin(node) + point + 1, end(node), begin(new_node));
+        new_node.n = node.n - point - 1;
+        node.n = point + 1;
+
+        // put the new key
+        if (place_right)
+            insert_key_to_index_no_split(new_node, key, after);
+        else
+            insert_key_to_index_no_split(node, key, after);
+
+        unmap(&new_node, node.next);
+        unmap(&node, offset);
+        set_prev(&new_node, new_node.next, node.next);
+        unlatch(new_latch);
+        unlatch(held);
+
+        // give the middle key to the parent
+        // note: middle key's child is reserved
+        key = middle_key;
+        old = offset;
+        after = node.next;
+        ++level;
+    }
+}
+
+template<class K, class V, size_t N, class C, class L>
+bool bplus_tree<K, V, N, C, L>::grow_root(size_t level, const key_t &key,
+                                          off_t old, off_t after)
+{
+    lock_meta();
+    if (meta.height != level || meta.root_offset != old) {
+        unlock_meta();
+        return false;
+    }
+
+    // create new root node
+    internal_node_t root;
+    root.next = root.prev = 0;
+    off_t offset = alloc(&root);
+
+    // insert `old` and `after`
+    root.n = 2;
+    root.children[0].key = key;
+    root.children[0].child = old;
+    root.children[1].key = key_t();
+    root.children[1].child = after;
+    unmap(&root, offset);
+
+    set_root(offset, meta.height + 1);
+    save_meta();
+    unlock_meta();
+    return true;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::set_root(off_t offset, size_t height)
+{
+    // readers take root and height only from the same generation
+    __atomic_store_n(&root_seq, root_seq + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&meta.root_offset, offset, __ATOMIC_RELEASE);
+    __atomic_store_n(&meta.height, height, __ATOMIC_RELEASE);
+    __atomic_store_n(&root_seq, root_seq + 1, __ATOMIC_RELEASE);
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::insert_key_to_index_no_split(
+        internal_node_t &node, const key_t &key, off_t value)
+{
+    index_array::make_room(node.children, node.n, key);
+    index_iterator where = upper_bound(begin(node), end(node) - 1, key);
+
+    // move later index forward
+    std::copy_backward(where, end(node), end(node) + 1);
+
+    // insert this key
+    where->key = key;
+    where->child = (where + 1)->child;
+    (where + 1)->child = value;
+
+    node.n++;
+}
+
+template<class K, class V, size_t N, class C, class L>
+off_t bplus_tree<K, V, N, C, L>::search_index(const key_t &key,
+                                              key_t *upper) const
+{
+    off_t org = meta.root_offset;
+    int height = meta.height;
+    while (height > 1) {
+        frame_t *frame;
+        internal_node_t *node = view<internal_node_t>(org, &frame);
+
+        index_iterator i = upper_bound(begin(*node), end(*node) - 1, key);
+        if (upper != NULL && i != end(*node) - 1)
+            *upper = i->key;
+        org = i->child;
+        release(frame);
+        --height;
+    }
+
+    return org;
+}
+
+template<class K, class V, size_t N, class C, class L>
+off_t bplus_tree<K, V, N, C, L>::search_leaf(off_t index, const key_t &key,
+                                             key_t *upper) const
+{
+    frame_t *frame;
+    internal_node_t *node = view<internal_node_t>(index, &frame);
+
+    index_iterator i = upper_bound(begin(*node), end(*node) - 1, key);
+    if (upper != NULL && i != end(*node) - 1)
+        *upper = i->key;
+    off_t child = i->child;
+    release(frame);
+    return child;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::root(off_t *offset, size_t *height) const
+{
+    if (!concurrent) {
+        *offset = meta.root_offset;
+        *height = meta.height;
+        return;
+    }
+
+    // retry while grow_root() is in the middle of changing both
+    for (;;) {
+        unsigned seq = __atomic_load_n(&root_seq, __ATOMIC_ACQUIRE);
+        *offset = __atomic_load_n(&meta.root_offset, __ATOMIC_ACQUIRE);
+        *height = __atomic_load_n(&meta.height, __ATOMIC_ACQUIRE);
+        if (seq % 2 == 0 && __atomic_load_n(&root_seq, __ATOMIC_ACQUIRE) == seq)
+            return;
+    }
+}
+
+template<class K, class V, size_t N, class C, class L>
+off_t bplus_tree<K, V, N, C, L>::descend(const key_t *key, size_t level,
+                                         std::vector<off_t> *path,
+                                         unsigned long *seq) const
+{
+    size_t depth = path != NULL ? path->size() : 0;
+    unsigned long s = structure_begin();
+    off_t org;
+    size_t height;
+    root(&org, &height);
+    if (height < level)
+        return 0;
+
+    while (height > level) {
+        unsigned long v = optimistic_begin(org);
+        frame_t *frame;
+        internal_node_t *node = view<internal_node_t>(org, &frame);
+
+        // a torn node may hold garbage, only act on it once validated
+        size_t n = node->n;
+        off_t next = 0;
+        bool down = false;
+        if (n > 0 && n <= index_array::capacity(node->children)) {
+            if (node->next != 0 &&
+                (key == NULL || beyond(node->children[n - 1].key, *key))) {
+                // split, but the parent doesn't know the new node yet
+                next = node->next;
+            } else {
+                index_iterator i = key != NULL
+                                   ? upper_bound(begin(*node),
+                                                 begin(*node) + n - 1, *key)
+                                   : begin(*node) + n - 1;
+                next = i->child;
+                down = true;
+            }
+        }
+        release(frame);
+
+        if (!optimistic_valid(org, v))
+            continue;
+        if (!structure_valid(s)) {
+            // the node may be gone, start over
+            if (path != NULL)
+                path->resize(depth);
+            s = structure_begin();
+            root(&org, &height);
+            if (height < level)
+                return 0;
+            continue;
+        }
+        assert(next != 0);
+        if (down) {
+            if (path != NULL)
+                path->push_back(org);
+            --height;
+        }
+        org = next;
+    }
+
+    if (seq != NULL)
+        *seq = s;
+    return org;
+}
+
+template<class K, class V, size_t N, class C, class L>
+off_t bplus_tree<K, V, N, C, L>::latch_leaf(const key_t *key,
+                                            latch_t **leaf_latch,
+                                            std::vector<off_t> *path,
+                                            unsigned long *seq) const
+{
+    size_t depth = path != NULL ? path->size() : 0;
+    unsigned long s;
+    off_t org = descend(key, 0, path, &s);
+    latch_t *held = latch(org, true);
+    for (;;) {
+        frame_t *frame;
+        leaf_node_t *leaf = view<leaf_node_t>(org, &frame);
+        off_t next = leaf->next;
+        bool right = next != 0 && (key == NULL || beyond(leaf->high, *key));
+        release(frame);
+
+        // a latched leaf stays, but it may have been merged away before
+        if (!structure_valid(s)) {
+            unlatch(held);
+            if (path != NULL)
+                path->resize(depth);
+            org = descend(key, 0, path, &s);
+            held = latch(org, true);
+            continue;
+        }
+        if (!right)
+            break;
+
+        // hold the sibling before letting this leaf go
+        latch_t *l = latch(next, true);
+        unlatch(held);
+        held = l;
+        org = next;
+    }
+
+    *leaf_latch = held;
+    if (seq != NULL)
+        *seq = s;
+    return org;
+}
+
+template<class K, class V, size_t N, class C, class L>
+template<class T>
+void bplus_tree<K, V, N, C, L>::node_create(off_t offset, T *node, T *next)
+{
+    // new sibling node
+    next->next = node->next;
+    next->prev = offset;
+    lock_meta();
+    node->next = alloc(next);
+    save_meta();
+    unlock_meta();
+}
+
+template<class K, class V, size_t N, class C, class L>
+template<class T>
+void bplus_tree<K, V, N, C, L>::set_prev(T *node, off_t offset, off_t prev)
+{
+    if (offset == 0)
+        return;
+
+    latch_t *held = latch(offset, true);
+    T header;
+    map(&header, offset, header_size);
+    header.prev = prev;
+    unmap(&header, offset, header_size);
+    unlatch(held);
+}
+
+template<class K, class V, size_t N, class C, class L>
+template<class T>
+void bplus_tree<K, V, N, C, L>::node_remove(T *prev, T *node)
+{
+    lock_meta();
+    unalloc(node, prev->next);
+    save_meta();
+    unlock_meta();
+
+    // the caller holds the latch of the next node too
+    prev->next = node->next;
+    if (node->next != 0) {
+        T next;
+        map(&next, node->next, header_size);
+        next.prev = node->prev;
+        unmap(&next, node->next, header_size);
+    }
+}
+
+template<class K, class V, size_t N, class C, class L>
+frame_t *bplus_tree<K, V, N, C, L>::pin(off_t offset, size_t size,
+                                        bool load) const
+{
+    assert(size <= block_size);
+
+    if (concurrent)
+        pthread_mutex_lock(&pool_mutex);
+
+    frame_t *frame = pool.find(offset);
+    while (frame == NULL) {
+        frame = pool.victim();
+        if (frame != NULL) {
+            if (frame->dirty) {
+                // the log goes to disk before the blocks it covers
+                if ((frame->lsn != 0 && wal.sync(frame->lsn) != 0) ||
+                    write_back(frame) != 0)
+                    write_failed = true;
+            }
+            pool.attach(frame, offset);
+            break;
+        }
+
+        // every frame is pinned by other threads right now
+        assert(concurrent);
+        pthread_mutex_unlock(&pool_mutex);
+        sched_yield();
+        pthread_mutex_lock(&pool_mutex);
+        frame = pool.find(offset);
+    }
+
+    // the frame only holds a prefix of the block, fetch the rest
+    if (frame->size < size) {
+        if (load && read_block(frame->data + frame->size,
+                               offset + frame->size,
+                               size - frame->size) != 0) {
+            if (frame->size == 0)
+                pool.detach(frame);
+            frame = NULL;
+        } else {
+            frame->size = size;
+        }
+    }
+
+    if (frame != NULL)
+        pool.pin(frame);
+    if (concurrent)
+        pthread_mutex_unlock(&pool_mutex);
+    return frame;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::remap(size_t size)
+{
+    size_t chunk = options.mmap_chunk;
+    size = (size + chunk - 1) / chunk * chunk;
+    if (size <= mapped)
+        return;
+    // doubling keeps the retired mappings few and their sum below the
+    // current one
+    if (size < mapped * 2)
+        size = mapped * 2;
+
+    struct stat st;
+    fstat(fd, &st);
+    if ((size_t)st.st_size < size)
+        ftruncate(fd, size);
+
+    // a shared mapping sees the writes made through any other one, so
+    // readers still inside the old mapping stay correct
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base != NULL)
+        retired.push_back(std::make_pair(base, mapped));
+    // falls back to the cache, which reads what the mapping wrote
+    if (addr == MAP_FAILED) {
+        addr = NULL;
+        size = 0;
+    }
+    __atomic_store_n(&base, (char *)addr, __ATOMIC_RELEASE);
+    __atomic_store_n(&mapped, size, __ATOMIC_RELEASE);
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::unmap_all()
+{
+    for (size_t i = 0; i < retired.size(); ++i)
+        munmap(retired[i].first, retired[i].second);
+    retired.clear();
+    if (base != NULL)
+        munmap(base, mapped);
+    base = NULL;
+    mapped = 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+frame_t *bplus_tree<K, V, N, C, L>::pin_logged(const void *block, off_t offset,
+                                               size_t size) const
+{
+    char before[block_size];
+    frame_t *frame = pin(offset, size, true);
+    if (frame != NULL) {
+        memcpy(before, frame->data, size);
+    } else {
+        // a new block, there is nothing to roll back to
+        bzero(before, size);
+        frame = pin(offset, size, false);
+    }
+
+    frame->lsn = wal.append(offset, size, before, block);
+    return frame;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::flush() const
+{
+    // blocks must not get ahead of the log
+    if (wal.enabled() && wal.sync() != 0)
+        return -1;
+
+    int ret = 0;
+    if (concurrent)
+        pthread_mutex_lock(&pool_mutex);
+    for (size_t i = 0; i < pool.capacity; i++) {
+        frame_t *frame = pool.frames + i;
+        if (frame->dirty) {
+            if (write_back(frame) == 0)
+                frame->dirty = false;
+            else
+                ret = -1;
+        }
+    }
+    if (concurrent)
+        pthread_mutex_unlock(&pool_mutex);
+    return ret;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::write_back(frame_t *frame) const
+{
+    if (cow) {
+        // the part of the block that is not cached moves along, read
+        // before the block moves so a failure leaves it where it was
+        off_t at = shadow.slot(block_index(frame->offset));
+        if (at != 0 && frame->size < block_size) {
+            size_t size = block_size - frame->size;
+            ssize_t rd = pread(fd, frame->data + frame->size, size,
+                               at + frame->size);
+            if (rd < 0)
+                return -1;
+            frame->size += rd;
+        }
+
+        off_t old;
+        shadow.relocate(block_index(frame->offset), &old);
+    }
+
+    return write_block(frame->data, frame->offset, frame->size);
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::load_commit()
+{
+    commit_t pages[2];
+    int newest = -1;
+    for (int i = 0; i < 2; i++) {
+        commit_t &c = pages[i];
+        ssize_t size = sizeof(c);
+        if (pread(fd, &c, size, i * COMMIT_PAGE) != size ||
+            checksum((char *)&c + sizeof(unsigned), size - sizeof(unsigned))
+                != c.checksum)
+            continue;
+        if (newest == -1 || c.seq > pages[newest].seq)
+            newest = i;
+    }
+
+    // a torn write of one page leaves the commit before it
+    if (newest == -1 || shadow.load(fd, pages[newest]) != 0)
+        return -1;
+    last_commit = pages[newest];
+    meta = last_commit.meta;
+    return 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::commit_shadow()
+{
+    // a commit pointing to a block that never got written is worse
+    // than keeping the last one
+    if (write_failed || flush() != 0)
+        return -1;
+    if (!shadow.changed() &&
+        memcmp(&meta, &last_commit.meta, sizeof(meta)) == 0)
+        return 0;
+
+    // everything the commit points to is on disk before the commit
+    commit_t c = last_commit;
+    if (shadow.save(fd, &c) != 0 || fdatasync(fd) != 0)
+        return -1;
+
+    c.seq++;
+    c.meta = meta;
+    c.checksum = checksum((char *)&c + sizeof(unsigned),
+                          sizeof(c) - sizeof(unsigned));
+    ssize_t size = sizeof(c);
+    if (pwrite(fd, &c, size, (c.seq % 2) * COMMIT_PAGE) != size ||
+        fdatasync(fd) != 0)
+        return -1;
+
+    last_commit = c;
+    shadow.committed();
+    return 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::set_group_commit(size_t ops, unsigned ms)
+{
+    pthread_mutex_lock(&commit_mutex);
+    commit_ops = ops > 0 ? ops : 1;
+    commit_ms = ms;
+    pthread_mutex_unlock(&commit_mutex);
+}
+
+template<class K, class V, size_t N, class C, class L>
+void *bplus_tree<K, V, N, C, L>::flush_loop(void *arg)
+{
+    bplus_tree &tree = *(bplus_tree *)arg;
+    pthread_mutex_lock(&tree.commit_mutex);
+    while (!tree.closing) {
+        if (tree.pending == 0) {
+            pthread_cond_wait(&tree.commit_cond, &tree.commit_mutex);
+            continue;
+        }
+
+        unsigned long due = tree.pending_since + tree.commit_ms;
+        if (now_ms() < due) {
+            struct timespec ts;
+            ts.tv_sec = due / 1000;
+            ts.tv_nsec = due % 1000 * 1000000;
+            pthread_cond_timedwait(&tree.commit_cond, &tree.commit_mutex,
+                                   &ts);
+            continue;
+        }
+        tree.pending = 0;
+        pthread_mutex_unlock(&tree.commit_mutex);
+
+        if (tree.cow) {
+            tree_lock lock(tree, true);
+            if (!tree.in_transaction)
+                tree.commit_shadow();
+        } else {
+            // a single writer marks the log on its way out of every write
+            if (tree.concurrent) {
+                tree_lock lock(tree, true);
+                tree.wal.mark();
+            }
+            tree.wal.sync();
+        }
+        pthread_mutex_lock(&tree.commit_mutex);
+    }
+    pthread_mutex_unlock(&tree.commit_mutex);
+    return NULL;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::commit(bool force)
+{
+    // the operations of a transaction count as one when it commits
+    if ((!wal.enabled() && !cow) || in_transaction)
+        return;
+
+    pthread_mutex_lock(&commit_mutex);
+    unsigned long now = now_ms();
+    if (pending++ == 0) {
+        pending_since = now;
+        pthread_cond_signal(&commit_cond);
+    }
+    bool due = force || pending >= commit_ops ||
+               now - pending_since >= commit_ms;
+    if (due)
+        pending = 0;
+    pthread_mutex_unlock(&commit_mutex);
+    if (!due)
+        return;
+
+    if (cow) {
+        tree_lock lock(*this, true);
+        commit_shadow();
+        return;
+    }
+
+    // writers that keep overlapping never leave a mark on their own
+    if (concurrent) {
+        tree_lock lock(*this, true);
+        wal.mark();
+    }
+
+    // one fsync for the whole group
+    wal.sync();
+
+    if (wal.size() >= options.checkpoint) {
+        tree_lock lock(*this, true);
+        if (wal.size() >= options.checkpoint)
+            checkpoint();
+    }
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::sync()
+{
+    if (in_transaction || !good())
+        return -1;
+
+    // wait for writes in progress
+    tree_lock lock(*this, true);
+    if (cow)
+        return commit_shadow();
+    if (!wal.enabled()) {
+        if (write_failed || flush() != 0)
+            return -1;
+        if (base != NULL && msync(base, mapped, MS_SYNC) != 0)
+            return -1;
+        return fsync(fd);
+    }
+
+    pthread_mutex_lock(&commit_mutex);
+    pending = 0;
+    pthread_mutex_unlock(&commit_mutex);
+    wal.mark();
+    return wal.sync();
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::begin_transaction()
+{
+    if (concurrent || in_transaction || !good())
+        return -1;
+
+    committed_meta = meta;
+    in_transaction = true;
+    return 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::commit_transaction()
+{
+    if (!in_transaction)
+        return -1;
+
+    // logged as one operation, a crash keeps all of it or none
+    log_scope scope(*this);
+    in_transaction = false;
+    std::map<off_t, dirty_block_t> blocks;
+    blocks.swap(dirty_blocks);
+    for (std::map<off_t, dirty_block_t>::iterator i = blocks.begin();
+         i != blocks.end(); ++i)
+        unmap(&i->second.data[0], i->first, i->second.size);
+    return 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::abort_transaction()
+{
+    if (!in_transaction)
+        return;
+
+    // blocks allocated since are past the old slot or back on the old
+    // free lists, nothing outside memory points to them
+    meta = committed_meta;
+    dirty_blocks.clear();
+    in_transaction = false;
+
+    // cursors may hold leaves that are gone now
+    structure_lock();
+    structure_unlock();
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::stage(const void *block, off_t offset,
+                                      size_t size) const
+{
+    dirty_block_t &dirty = dirty_blocks[offset];
+    if (dirty.data.empty()) {
+        // reads of the rest of the block see it as it was
+        dirty.size = 0;
+        dirty.data.resize(block_size);
+        read_whole(offset, &dirty.data[0]);
+    }
+
+    memcpy(&dirty.data[0], block, size);
+    dirty.size = std::max(dirty.size, size);
+}
+
+template<class K, class V, size_t N, class C, class L>
+int bplus_tree<K, V, N, C, L>::checkpoint()
+{
+    // the log is all there is of a block that didn't make it
+    if (write_failed || flush() != 0 || fsync(fd) != 0)
+        return -1;
+    wal.reset();
+    return 0;
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::init_from_empty()
+{
+    // init default meta
+    empty_meta();
+    meta.height = 1;
+
+    // init root node
+    internal_node_t root;
+    root.next = root.prev = 0;
+    meta.root_offset = alloc(&root);
+
+    // init empty leaf
+    leaf_node_t leaf;
+    leaf.next = leaf.prev = 0;
+    meta.leaf_offset = root.children[0].child = alloc(&leaf);
+
+    // save
+    save_meta();
+    unmap(&root, meta.root_offset);
+    unmap(&leaf, root.children[0].child);
+}
+
+template<class K, class V, size_t N, class C, class L>
+void bplus_tree<K, V, N, C, L>::empty_meta()
+{
+    bzero(&meta, sizeof(meta_t));
+    meta.order = order;
+    meta.value_size = sizeof(value_t);
+    meta.key_size = sizeof(key_t);
+    meta.page_size = BP_PAGE_SIZE;
+    meta.slot = block_start;
+}
+
+}
+
+#endif /* end of BPT_IMPL_H */
@@ -1,48 +1,165 @@
 #ifndef PREDEFINED_H
 #define PREDEFINED_H
 
+#include <assert.h>
+#include <stdint.h>
 #include <string.h>
 
 namespace bpt {
 
-/* predefined B+ info */
-#define BP_ORDER 20
+/* nodes are laid out so that none straddles pages of this size, a power
+ * of two such as 4096, 8192 or 16384, it is part of every node layout, so
+ * it is one for the whole program and changed here only */
+#define BP_PAGE_SIZE 4096
 
-/* key/value type */
+/* runtime settings of a tree, passed to its constructor */
+struct options_t {
+    size_t cache_size; /* how many blocks are cached in memory */
+    size_t mmap_chunk; /* how much the file grows at a time in BP_MMAP mode */
+
+    /* BP_WAL and BP_COW: sync the log or commit after this many writes
+     * or milliseconds */
+    size_t commit_ops;
+    unsigned commit_ms;
+
+    /* BP_WAL: write back all blocks and empty the log when it grows this
+     * big */
+    size_t checkpoint;
+
+    options_t()
+        : cache_size(1024), mmap_chunk(64 * 1024 * 1024), commit_ops(64),
+          commit_ms(10), checkpoint(64 * 1024 * 1024) {}
+};
+
+/* what trees get when they are given no options, can be changed before
+ * they are created */
+options_t &default_options();
+
+/* default key/value type, the key is a string of up to 16 bytes kept
+ * right-aligned behind zeros, so comparing the raw bytes puts shorter
+ * keys first and keys of the same length in strcmp() order, and the
+ * empty key is all zeros */
 typedef int value_t;
 struct key_t {
     char k[16];
 
     key_t(const char *str = "")
     {
-        bzero(k, sizeof(k));
-        strcpy(k, str);
+        size_t n = strnlen(str, sizeof(k));
+        bzero(k, sizeof(k) - n);
+        memcpy(k + sizeof(k) - n, str, n);
     }
 
     operator bool() const {
-        return strcmp(k, "");
+        return k[sizeof(k) - 1] != 0;
+    }
+
+    /* the string, not terminated */
+    const char *data() const
+    {
+        return k + sizeof(k) - size();
+    }
+
+    size_t size() const
+    {
+        size_t i = 0;
+        while (i < sizeof(k) && k[i] == 0)
+            ++i;
+        return sizeof(k) - i;
+    }
+
+    /* 8 bytes at `i` as a number that orders like them */
+    uint64_t word(size_t i) const
+    {
+        uint64_t w;
+        memcpy(&w, k + i, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        return w;
+    }
+
+    /* the other way round */
+    void set_word(size_t i, uint64_t w)
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        memcpy(k + i, &w, sizeof(w));
     }
 };
 
 inline int keycmp(const key_t &a, const key_t &b) {
-    int x = strlen(a.k) - strlen(b.k);
-    return x == 0 ? strcmp(a.k, b.k) : x;
+    uint64_t x = a.word(0), y = b.word(0);
+    if (x == y) {
+        x = a.word(8);
+        y = b.word(8);
+    }
+    return (x > y) - (x < y);
+}
+
+/* 64-bit integer keys, held as an unsigned word that orders like them
+ * with 0 left for the empty key, so the largest u64_key and the smallest
+ * i64_key can't be keys */
+struct u64_key {
+    uint64_t w;
+
+    u64_key() : w(0) {}
+    u64_key(uint64_t v) : w(v + 1)
+    {
+        assert(v != UINT64_MAX);
+    }
+
+    operator bool() const {
+        return w != 0;
+    }
+
+    uint64_t value() const {
+        return w - 1;
+    }
+};
+
+struct i64_key {
+    uint64_t w;
+
+    i64_key() : w(0) {}
+    i64_key(int64_t v) : w((uint64_t)v ^ (1ULL << 63))
+    {
+        assert(v != INT64_MIN);
+    }
+
+    operator bool() const {
+        return w != 0;
+    }
+
+    int64_t value() const {
+        return (int64_t)(w ^ (1ULL << 63));
+    }
+};
+
+inline int keycmp(const u64_key &a, const u64_key &b) {
+    return (a.w > b.w) - (a.w < b.w);
+}
+
+inline int keycmp(const i64_key &a, const i64_key &b) {
+    return (a.w > b.w) - (a.w < b.w);
 }
 
-#define OPERATOR_KEYCMP(type) \
-    bool operator< (const key_t &l, const type &r) {\
-        return keycmp(l, r.key) < 0;\
-    }\
-    bool operator< (const type &l, const key_t &r) {\
-        return keycmp(l.key, r) < 0;\
-    }\
-    bool operator== (const key_t &l, const type &r) {\
-        return keycmp(l, r.key) == 0;\
-    }\
-    bool operator== (const type &l, const key_t &r) {\
-        return keycmp(l.key, r) == 0;\
+/* default order of keys */
+struct key_compare {
+    int operator()(const key_t &a, const key_t &b) const {
+        return keycmp(a, b);
+    }
+
+    int operator()(const u64_key &a, const u64_key &b) const {
+        return keycmp(a, b);
     }
 
+    int operator()(const i64_key &a, const i64_key &b) const {
+        return keycmp(a, b);
+    }
+};
+
 }
 
 #endif /* end of PREDEFINED_H */
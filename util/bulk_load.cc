@@ -0,0 +1,41 @@
+#include "../bpt.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[])
+{
+    double fill = 1.0;
+    if (argc > 2)
+        fill = atof(argv[2]);
+
+    if (argc < 2 || fill <= 0 || fill > 1) {
+        fprintf(stderr, "usage: %s database [fill] < sorted records\n",
+                argv[0]);
+        fprintf(stderr, "every line of input is \"key value\"\n");
+        return 1;
+    }
+
+    bpt::bplus_tree<> database(argv[1], true);
+    bpt::bplus_tree<>::bulk_loader loader(database, fill);
+
+    char line[256], key[256];
+    bpt::value_t value;
+    size_t count = 0;
+    while (fgets(line, sizeof(line), stdin)) {
+        if (sscanf(line, "%255s %d", key, &value) != 2)
+            continue;
+        if (strlen(key) > sizeof(bpt::key_t)) {
+            fprintf(stderr, "Key %s is too long\n", key);
+            return 1;
+        }
+        if (loader.add(key, value) != 0) {
+            fprintf(stderr, "Key %s is out of order\n", key);
+            return 1;
+        }
+        ++count;
+    }
+    loader.finish();
+    printf("%zu records\n", count);
+
+    return 0;
+}
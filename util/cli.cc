@@ -10,7 +10,13 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    bpt::bplus_tree database(argv[1]);
+    bpt::bplus_tree<> database(argv[1]);
+    if (!database.good()) {
+        fprintf(stderr, "Cannot open %s, or its nodes have another "
+                "layout\n", argv[1]);
+        return 1;
+    }
+
     if (!strcmp(argv[2], "search")) {
         if (argc < 4) {
             fprintf(stderr, "Need key.\n");
@@ -24,18 +30,23 @@ int main(int argc, char *argv[])
             else
                 printf("%d\n", value);
         } else {
-            bpt::key_t start(argv[3]);
-            value_t values[512];
-            bool next = true;
-            while (next) {
-                int ret = database.search_range(
-                        &start, argv[4], values, 512, &next);
-                if (ret < 0)
-                    break;
-                for (int i = 0; i < ret; i++)
-                    printf("%d\n", values[i]);
-            }
+            bpt::key_t end(argv[4]);
+            bplus_tree<>::cursor c(database);
+            for (c.seek(argv[3]); c.valid() && keycmp(c.key(), end) <= 0;
+                 c.next())
+                printf("%d\n", c.value());
         }
+    } else if (!strcmp(argv[2], "before")) {
+        if (argc < 5) {
+            fprintf(stderr, "Format is [before key count]\n");
+            return 1;
+        }
+
+        // newest first
+        bplus_tree<>::cursor c(database);
+        int count = atoi(argv[4]);
+        for (c.seek_before(argv[3]); count > 0 && c.valid(); c.prev(), count--)
+            printf("%d\n", c.value());
     } else if (!strcmp(argv[2], "insert")) {
         if (argc < 5) {
             fprintf(stderr, "Format is [insert key value]\n");
@@ -0,0 +1,34 @@
+#include "../bpt.h"
+#include <stdio.h>
+#include <sys/stat.h>
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s database\n", argv[0]);
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(argv[1], &st) != 0) {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    off_t before = st.st_size;
+
+    bpt::bplus_tree<> database(argv[1]);
+    if (!database.good()) {
+        fprintf(stderr, "Cannot open %s, or its nodes have another "
+                "layout\n", argv[1]);
+        return 1;
+    }
+    if (database.compact() != 0) {
+        fprintf(stderr, "Failed to compact %s\n", argv[1]);
+        return 1;
+    }
+
+    stat(argv[1], &st);
+    printf("%lld -> %lld bytes\n", (long long)before, (long long)st.st_size);
+
+    return 0;
+}
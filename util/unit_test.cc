@@ -2,17 +2,202 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
 #include <algorithm>
+#include <vector>
 
 #define PRINT(a) fprintf(stderr, "\033[33m%s\033[0m \033[32m%s\033[0m\n", a, "Passed")
 
 #include "../bpt.h"
-using bpt::bplus_tree;
+
+/* test keys sort like plain strings */
+struct string_compare {
+    int operator()(const bpt::key_t &l, const bpt::key_t &r) const
+    {
+        size_t n = std::min(l.size(), r.size());
+        int x = memcmp(l.data(), r.data(), n);
+        return x != 0 ? x : (int)l.size() - (int)r.size();
+    }
+};
+
+/* small nodes, so a few keys split and merge them */
+typedef bpt::bplus_tree<bpt::key_t, bpt::value_t, 4, string_compare>
+        bplus_tree;
+typedef bplus_tree::internal_node_t internal_node_t;
+typedef bplus_tree::leaf_node_t leaf_node_t;
+typedef bplus_tree::record_t record_t;
+
+/* shared by the threads of the concurrent test */
+struct worker_t {
+    bplus_tree *tree;
+    int id;
+    int threads;
+    int keys;
+};
+
+static void *concurrent_writer(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    for (int i = w->id; i < w->keys; i += w->threads) {
+        char key[16] = { 0 };
+        sprintf(key, "%05d", i);
+        assert(w->tree->insert(key, i) == 0);
+    }
+
+    // take the odd ones out again, leaves merge with other threads' keys
+    for (int i = w->id; i < w->keys; i += w->threads) {
+        char key[16] = { 0 };
+        sprintf(key, "%05d", i);
+        bpt::value_t value;
+        assert(w->tree->search(key, &value) == 0 && value == i);
+        if (i % 2 == 1)
+            assert(w->tree->remove(key) == 0);
+        else
+            assert(w->tree->update(key, i * 2) == 0);
+    }
+    return NULL;
+}
+
+static void *concurrent_reader(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    for (int round = 0; round < 8; round++) {
+        // keys always come in order while leaves split and merge
+        bplus_tree::cursor c(*w->tree);
+        bpt::key_t last;
+        bool first = true;
+        for (c.seek_first(); c.valid(); c.next()) {
+            assert(first || bplus_tree::keycmp(last, c.key()) < 0);
+            last = c.key();
+            first = false;
+        }
+    }
+    return NULL;
+}
+
+/* takes the exclusive tree latch, which waits for readers in progress */
+static void *exclusive_holder(void *arg)
+{
+    bplus_tree *tree = (bplus_tree *)arg;
+    bplus_tree::tree_lock lock(*tree, true);
+    return NULL;
+}
+
+/* compacts a tree while the caller holds snapshots of it */
+struct compact_job {
+    bplus_tree *tree;
+    int ret;
+};
+
+static void *compact_tree(void *arg)
+{
+    compact_job *job = (compact_job *)arg;
+    __atomic_store_n(&job->ret, job->tree->compact(), __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* runs a tree of any layout through inserts, removes, scans, batches,
+ * snapshots, compaction and bulk loading, checking it against a bitmap,
+ * key `i` is the number `i * step` */
+template<class Tree>
+static void check_tree(const char *path, int keys, long step = 1)
+{
+    std::vector<char> has(keys, 0);
+    Tree tree(path, true);
+    for (int round = 0; round < 4; round++) {
+        for (int k = 0; k < keys; k++) {
+            int i = rand() % keys;
+            char key[24] = { 0 };
+            sprintf(key, "%05ld", i * step);
+            if (rand() % 3 == 0) {
+                assert((tree.remove(key) == 0) == (has[i] == 1));
+                has[i] = 0;
+            } else {
+                assert((tree.insert(key, i) == 0) == (has[i] == 0));
+                has[i] = 1;
+            }
+        }
+
+        {
+        typename Tree::read_view view = tree.snapshot();
+        typename Tree::record_t batch[16];
+        for (int k = 0; k < 16; k++) {
+            int i = rand() % keys;
+            char key[24] = { 0 };
+            sprintf(key, "%05ld", i * step);
+            batch[k].key = key;
+            batch[k].value = i;
+        }
+        tree.insert_batch(batch, 16);
+        for (int k = 0; k < 16; k++)
+            has[batch[k].value] = 1;
+
+        // every key in order, the snapshot is still as it was
+        typename Tree::cursor c(tree);
+        int i = 0;
+        for (c.seek_first(); c.valid(); c.next(), i++) {
+            while (!has[i])
+                i++;
+            char key[24] = { 0 };
+            sprintf(key, "%05ld", i * step);
+            assert(Tree::keycmp(c.key(), key) == 0 && c.value() == i);
+        }
+        for (; i < keys; i++)
+            assert(!has[i]);
+        typename Tree::cursor old(view);
+        for (old.seek_first(); old.valid(); old.next()) {
+            bpt::value_t value;
+            assert(view.search(old.key(), &value) == 0);
+        }
+        }
+
+        bpt::key_t probes[64];
+        bpt::value_t values[64];
+        int status[64];
+        for (int k = 0; k < 64; k++) {
+            char key[24] = { 0 };
+            sprintf(key, "%05ld", rand() % keys * step);
+            probes[k] = key;
+        }
+        tree.search_many(probes, values, status, 64);
+        for (int k = 0; k < 64; k++) {
+            bpt::value_t value;
+            assert(status[k] == tree.search(probes[k], &value));
+            assert(status[k] != 0 || values[k] == value);
+        }
+        assert(tree.compact() == 0);
+    }
+
+    {
+    Tree copy("test2.db", true);
+    typename Tree::bulk_loader loader(copy, 0.7);
+    typename Tree::cursor c(tree);
+    for (c.seek_first(); c.valid(); c.next())
+        loader.add(c.key(), c.value());
+    loader.finish();
+    for (int i = 0; i < keys; i++) {
+        char key[24] = { 0 };
+        sprintf(key, "%05ld", i * step);
+        bpt::value_t value;
+        assert((copy.search(key, &value) == 0) == (has[i] == 1));
+        if (i % 2 == 0 && has[i])
+            assert(copy.remove(key) == 0);
+    }
+    }
+    unlink("test2.db");
+}
 
 int main(int argc, char *argv[])
 {
     const int size = 128;
 
+    // a small cache and mapping chunk, and frequent checkpoints
+    bpt::options_t &options = bpt::default_options();
+    options.cache_size = 8;
+    options.mmap_chunk = 4096;
+    options.checkpoint = 64 * 1024;
+
     {
     bplus_tree tree("test.db", true);
     assert(tree.meta.order == 4);
@@ -49,13 +234,13 @@ int main(int argc, char *argv[])
     assert(tree.meta.leaf_node_num == 1);
     assert(tree.meta.height == 1);
 
-    bpt::leaf_node_t leaf;
+    leaf_node_t leaf;
     tree.map(&leaf, tree.search_leaf("t1"));
     assert(leaf.n == 4);
-    assert(bpt::keycmp(leaf.children[0].key, "t1") == 0);
-    assert(bpt::keycmp(leaf.children[1].key, "t2") == 0);
-    assert(bpt::keycmp(leaf.children[2].key, "t3") == 0);
-    assert(bpt::keycmp(leaf.children[3].key, "t4") == 0);
+    assert(bplus_tree::keycmp(leaf.children[0].key, "t1") == 0);
+    assert(bplus_tree::keycmp(leaf.children[1].key, "t2") == 0);
+    assert(bplus_tree::keycmp(leaf.children[2].key, "t3") == 0);
+    assert(bplus_tree::keycmp(leaf.children[3].key, "t4") == 0);
     bpt::value_t value;
     assert(tree.search("t1", &value) == 0);
     assert(value == 1);
@@ -83,29 +268,29 @@ int main(int argc, char *argv[])
     assert(tree.meta.leaf_node_num == 2);
     assert(tree.meta.height == 1);
 
-    bpt::internal_node_t index;
+    internal_node_t index;
     off_t index_off = tree.search_index("t1");
     tree.map(&index, index_off);
     assert(index.n == 2);
-    assert(index.parent == 0);
-    assert(bpt::keycmp(index.children[0].key, "t4") == 0);
+    assert(index_off == tree.meta.root_offset);
+    assert(bplus_tree::keycmp(index.children[0].key, "t4") == 0);
 
-    bpt::leaf_node_t leaf1, leaf2;
+    leaf_node_t leaf1, leaf2;
     off_t leaf1_off = tree.search_leaf("t1");
     assert(leaf1_off == index.children[0].child);
     tree.map(&leaf1, leaf1_off);
     assert(leaf1.n == 3);
-    assert(bpt::keycmp(leaf1.children[0].key, "t1") == 0);
-    assert(bpt::keycmp(leaf1.children[1].key, "t2") == 0);
-    assert(bpt::keycmp(leaf1.children[2].key, "t3") == 0);
+    assert(bplus_tree::keycmp(leaf1.children[0].key, "t1") == 0);
+    assert(bplus_tree::keycmp(leaf1.children[1].key, "t2") == 0);
+    assert(bplus_tree::keycmp(leaf1.children[2].key, "t3") == 0);
 
     off_t leaf2_off = tree.search_leaf("t4");
     assert(leaf1.next == leaf2_off);
     assert(leaf2_off == index.children[1].child);
     tree.map(&leaf2, leaf2_off);
     assert(leaf2.n == 2);
-    assert(bpt::keycmp(leaf2.children[0].key, "t4") == 0);
-    assert(bpt::keycmp(leaf2.children[1].key, "t5") == 0);
+    assert(bplus_tree::keycmp(leaf2.children[0].key, "t4") == 0);
+    assert(bplus_tree::keycmp(leaf2.children[1].key, "t5") == 0);
 
     PRINT("SplitLeafBy2");
     }
@@ -145,15 +330,15 @@ int main(int argc, char *argv[])
     assert(tree.meta.leaf_node_num == 3);
     assert(tree.meta.height == 1);
 
-    bpt::internal_node_t index;
+    internal_node_t index;
     off_t index_off = tree.search_index("t8");
     tree.map(&index, index_off);
     assert(index.n == 3);
-    assert(index.parent == 0);
-    assert(bpt::keycmp(index.children[0].key, "t4") == 0);
-    assert(bpt::keycmp(index.children[1].key, "t7") == 0);
+    assert(index_off == tree.meta.root_offset);
+    assert(bplus_tree::keycmp(index.children[0].key, "t4") == 0);
+    assert(bplus_tree::keycmp(index.children[1].key, "t7") == 0);
 
-    bpt::leaf_node_t leaf1, leaf2, leaf3;
+    leaf_node_t leaf1, leaf2, leaf3;
     off_t leaf1_off = tree.search_leaf("t3");
     off_t leaf2_off = tree.search_leaf("t5");
     off_t leaf3_off = tree.search_leaf("ta");
@@ -196,7 +381,7 @@ int main(int argc, char *argv[])
     assert(tree.meta.leaf_node_num == 5);
     assert(tree.meta.height == 2);
 
-    bpt::internal_node_t node1, node2, root;
+    internal_node_t node1, node2, root;
     tree.map(&root, tree.meta.root_offset);
     off_t node1_off = tree.search_index("t03");
     off_t node2_off = tree.search_index("t14");
@@ -205,12 +390,12 @@ int main(int argc, char *argv[])
     assert(root.n == 2);
     assert(root.children[0].child == node1_off);
     assert(root.children[1].child == node2_off);
-    assert(bpt::keycmp(root.children[0].key, "t09") == 0);
+    assert(bplus_tree::keycmp(root.children[0].key, "t09") == 0);
     assert(node1.n == 3);
-    assert(bpt::keycmp(node1.children[0].key, "t03") == 0);
-    assert(bpt::keycmp(node1.children[1].key, "t06") == 0);
+    assert(bplus_tree::keycmp(node1.children[0].key, "t03") == 0);
+    assert(bplus_tree::keycmp(node1.children[1].key, "t06") == 0);
     assert(node2.n == 2);
-    assert(bpt::keycmp(node2.children[0].key, "t12") == 0);
+    assert(bplus_tree::keycmp(node2.children[0].key, "t12") == 0);
 
     bpt::value_t value;
     for (int i = 0; i < 10; i++) {
@@ -246,12 +431,12 @@ int main(int argc, char *argv[])
     assert(tree.meta.leaf_node_num == 4);
     assert(tree.meta.height == 1);
 
-    bpt::internal_node_t node;
+    internal_node_t node;
     tree.map(&node, tree.meta.root_offset);
     assert(node.n == 4);
-    assert(bpt::keycmp(node.children[0].key, "11") == 0);
-    assert(bpt::keycmp(node.children[1].key, "3") == 0);
-    assert(bpt::keycmp(node.children[2].key, "6") == 0);
+    assert(bplus_tree::keycmp(node.children[0].key, "11") == 0);
+    assert(bplus_tree::keycmp(node.children[1].key, "3") == 0);
+    assert(bplus_tree::keycmp(node.children[2].key, "6") == 0);
 
     off_t off1 = tree.search_leaf("0");
     off_t off2 = tree.search_leaf("11");
@@ -261,7 +446,7 @@ int main(int argc, char *argv[])
     assert(node.children[1].child == off2);
     assert(node.children[2].child == off3);
     assert(node.children[3].child == off4);
-    bpt::leaf_node_t node1, node2, node3, node4;
+    leaf_node_t node1, node2, node3, node4;
     tree.map(&node1, off1);
     tree.map(&node2, off2);
     tree.map(&node3, off3);
@@ -298,12 +483,12 @@ int main(int argc, char *argv[])
     assert(tree.meta.leaf_node_num == 4);
     assert(tree.meta.height == 1);
 
-    bpt::internal_node_t node;
+    internal_node_t node;
     tree.map(&node, tree.meta.root_offset);
     assert(node.n == 4);
-    assert(bpt::keycmp(node.children[0].key, "3") == 0);
-    assert(bpt::keycmp(node.children[1].key, "51") == 0);
-    assert(bpt::keycmp(node.children[2].key, "6") == 0);
+    assert(bplus_tree::keycmp(node.children[0].key, "3") == 0);
+    assert(bplus_tree::keycmp(node.children[1].key, "51") == 0);
+    assert(bplus_tree::keycmp(node.children[2].key, "6") == 0);
 
     off_t off1 = tree.search_leaf("0");
     off_t off2 = tree.search_leaf("3");
@@ -313,7 +498,7 @@ int main(int argc, char *argv[])
     assert(node.children[1].child == off2);
     assert(node.children[2].child == off3);
     assert(node.children[3].child == off4);
-    bpt::leaf_node_t node1, node2, node3, node4;
+    leaf_node_t node1, node2, node3, node4;
     tree.map(&node1, off1);
     tree.map(&node2, off2);
     tree.map(&node3, off3);
@@ -350,21 +535,21 @@ int main(int argc, char *argv[])
     assert(tree.meta.leaf_node_num == 5);
     assert(tree.meta.height == 2);
 
-    bpt::internal_node_t node1, node2, root;
+    internal_node_t node1, node2, root;
     tree.map(&root, tree.meta.root_offset);
     off_t node1_off = tree.search_index("0");
     off_t node2_off = tree.search_index("6");
     tree.map(&node1, node1_off);
     tree.map(&node2, node2_off);
     assert(root.n == 2);
-    assert(bpt::keycmp(root.children[0].key, "3") == 0);
+    assert(bplus_tree::keycmp(root.children[0].key, "3") == 0);
     assert(root.children[0].child == node1_off);
     assert(root.children[1].child == node2_off);
     assert(node1.n == 3);
-    assert(bpt::keycmp(node1.children[0].key, "11") == 0);
-    assert(bpt::keycmp(node1.children[1].key, "14") == 0);
+    assert(bplus_tree::keycmp(node1.children[0].key, "11") == 0);
+    assert(bplus_tree::keycmp(node1.children[1].key, "14") == 0);
     assert(node2.n == 2);
-    assert(bpt::keycmp(node2.children[0].key, "6") == 0);
+    assert(bplus_tree::keycmp(node2.children[0].key, "6") == 0);
     for (int i = 0; i < 15; i++) {
         char key[8] = { 0 };
         sprintf(key, "%d", i);
@@ -390,7 +575,7 @@ int main(int argc, char *argv[])
     assert(tree.meta.leaf_node_num == 10);
     assert(tree.meta.height == 2);
 
-    bpt::internal_node_t node1, node2, node3, node4, root;
+    internal_node_t node1, node2, node3, node4, root;
     tree.map(&root, tree.meta.root_offset);
     off_t node1_off = tree.search_index("11");
     off_t node2_off = tree.search_index("22");
@@ -411,23 +596,23 @@ int main(int argc, char *argv[])
     assert(node4.prev == node3_off);
     assert(node4.next == 0);
     assert(root.n == 4);
-    assert(bpt::keycmp(root.children[0].key, "17") == 0);
-    assert(bpt::keycmp(root.children[1].key, "25") == 0);
-    assert(bpt::keycmp(root.children[2].key, "3") == 0);
+    assert(bplus_tree::keycmp(root.children[0].key, "17") == 0);
+    assert(bplus_tree::keycmp(root.children[1].key, "25") == 0);
+    assert(bplus_tree::keycmp(root.children[2].key, "3") == 0);
     assert(root.children[0].child == node1_off);
     assert(root.children[1].child == node2_off);
     assert(root.children[2].child == node3_off);
     assert(root.children[3].child == node4_off);
     assert(node1.n == 3);
-    assert(bpt::keycmp(node1.children[0].key, "11") == 0);
-    assert(bpt::keycmp(node1.children[1].key, "14") == 0);
+    assert(bplus_tree::keycmp(node1.children[0].key, "11") == 0);
+    assert(bplus_tree::keycmp(node1.children[1].key, "14") == 0);
     assert(node2.n == 3);
-    assert(bpt::keycmp(node2.children[0].key, "2") == 0);
-    assert(bpt::keycmp(node2.children[1].key, "22") == 0);
+    assert(bplus_tree::keycmp(node2.children[0].key, "2") == 0);
+    assert(bplus_tree::keycmp(node2.children[1].key, "22") == 0);
     assert(node3.n == 2);
-    assert(bpt::keycmp(node3.children[0].key, "28") == 0);
+    assert(bplus_tree::keycmp(node3.children[0].key, "28") == 0);
     assert(node4.n == 2);
-    assert(bpt::keycmp(node4.children[0].key, "6") == 0);
+    assert(bplus_tree::keycmp(node4.children[0].key, "6") == 0);
 
     for (int i = 0; i < 30; i++) {
         char key[8] = { 0 };
@@ -454,34 +639,34 @@ int main(int argc, char *argv[])
     assert(tree.meta.leaf_node_num == 17);
     assert(tree.meta.height == 3);
 
-    bpt::internal_node_t root;
+    internal_node_t root;
     tree.map(&root, tree.meta.root_offset);
     assert(root.n == 2);
-    assert(bpt::keycmp(root.children[0].key, "3") == 0);
+    assert(bplus_tree::keycmp(root.children[0].key, "3") == 0);
 
-    bpt::internal_node_t node1, node2;
+    internal_node_t node1, node2;
     tree.map(&node1, root.children[0].child);
     tree.map(&node2, root.children[1].child);
     assert(node1.n == 3);
-    assert(bpt::keycmp(node1.children[0].key, "17") == 0);
-    assert(bpt::keycmp(node1.children[1].key, "25") == 0);
+    assert(bplus_tree::keycmp(node1.children[0].key, "17") == 0);
+    assert(bplus_tree::keycmp(node1.children[1].key, "25") == 0);
     assert(node2.n == 3);
-    assert(bpt::keycmp(node2.children[0].key, "4") == 0);
-    assert(bpt::keycmp(node2.children[1].key, "45") == 0);
+    assert(bplus_tree::keycmp(node2.children[0].key, "4") == 0);
+    assert(bplus_tree::keycmp(node2.children[1].key, "45") == 0);
 
-    bpt::internal_node_t node3, node4, node5;
+    internal_node_t node3, node4, node5;
     tree.map(&node3, node2.children[0].child);
     assert(node3.n == 4);
-    assert(bpt::keycmp(node3.children[0].key, "32") == 0);
-    assert(bpt::keycmp(node3.children[1].key, "35") == 0);
-    assert(bpt::keycmp(node3.children[2].key, "38") == 0);
+    assert(bplus_tree::keycmp(node3.children[0].key, "32") == 0);
+    assert(bplus_tree::keycmp(node3.children[1].key, "35") == 0);
+    assert(bplus_tree::keycmp(node3.children[2].key, "38") == 0);
     tree.map(&node4, node2.children[1].child);
     assert(node4.n == 2);
-    assert(bpt::keycmp(node4.children[0].key, "42") == 0);
+    assert(bplus_tree::keycmp(node4.children[0].key, "42") == 0);
     tree.map(&node5, node2.children[2].child);
     assert(node5.n == 3);
-    assert(bpt::keycmp(node5.children[0].key, "48") == 0);
-    assert(bpt::keycmp(node5.children[1].key, "6") == 0);
+    assert(bplus_tree::keycmp(node5.children[0].key, "48") == 0);
+    assert(bplus_tree::keycmp(node5.children[1].key, "6") == 0);
 
     for (int i = 0; i < 49; i++) {
         char key[8] = { 0 };
@@ -663,7 +848,7 @@ int main(int argc, char *argv[])
 
     {
     bplus_tree tree("test.db");
-    bpt::leaf_node_t leaf;
+    leaf_node_t leaf;
     off_t offset = tree.meta.leaf_offset;
     off_t last = 0;
     size_t counter = 0;
@@ -693,21 +878,21 @@ int main(int argc, char *argv[])
     assert(tree.remove("t3") == 0);
     assert(tree.remove("t3") != 0);
 
-    bpt::leaf_node_t leaf;
+    leaf_node_t leaf;
     tree.map(&leaf, tree.meta.leaf_offset);
     assert(leaf.n == 3);
-    assert(bpt::keycmp(leaf.children[0].key, "t1") == 0);
-    assert(bpt::keycmp(leaf.children[1].key, "t2") == 0);
-    assert(bpt::keycmp(leaf.children[2].key, "t4") == 0);
+    assert(bplus_tree::keycmp(leaf.children[0].key, "t1") == 0);
+    assert(bplus_tree::keycmp(leaf.children[1].key, "t2") == 0);
+    assert(bplus_tree::keycmp(leaf.children[2].key, "t4") == 0);
     assert(tree.remove("t1") == 0);
     tree.map(&leaf, tree.meta.leaf_offset);
     assert(leaf.n == 2);
-    assert(bpt::keycmp(leaf.children[0].key, "t2") == 0);
-    assert(bpt::keycmp(leaf.children[1].key, "t4") == 0);
+    assert(bplus_tree::keycmp(leaf.children[0].key, "t2") == 0);
+    assert(bplus_tree::keycmp(leaf.children[1].key, "t4") == 0);
     assert(tree.remove("t2") == 0);
     tree.map(&leaf, tree.meta.leaf_offset);
     assert(leaf.n == 1);
-    assert(bpt::keycmp(leaf.children[0].key, "t4") == 0);
+    assert(bplus_tree::keycmp(leaf.children[0].key, "t4") == 0);
     assert(tree.remove("t4") == 0);
     tree.map(&leaf, tree.meta.leaf_offset);
     assert(leaf.n == 0);
@@ -727,51 +912,47 @@ int main(int argc, char *argv[])
 
     {
     bplus_tree tree("test.db");
-    bpt::leaf_node_t leaf;
-    bpt::internal_node_t node;
+    leaf_node_t leaf;
+    internal_node_t node;
     assert(tree.meta.leaf_node_num == 3);
     assert(tree.meta.internal_node_num == 1);
 
     // | 3 6  |
     // | 0 1 2 | 3 4 5 | 6 7 8 9 |
     tree.map(&node, tree.meta.root_offset);
-    assert(bpt::keycmp(node.children[0].key, "03") == 0);
-    assert(bpt::keycmp(node.children[1].key, "06") == 0);
+    assert(bplus_tree::keycmp(node.children[0].key, "03") == 0);
+    assert(bplus_tree::keycmp(node.children[1].key, "06") == 0);
     assert(tree.remove("03") == 0);
     assert(tree.remove("04") == 0);
     // | 2 6  |
     // | 0 1 | 2 5 | 6 7 8 9 |
     tree.map(&node, tree.meta.root_offset);
-    assert(bpt::keycmp(node.children[0].key, "02") == 0);
-    assert(bpt::keycmp(node.children[1].key, "06") == 0);
+    assert(bplus_tree::keycmp(node.children[0].key, "02") == 0);
+    assert(bplus_tree::keycmp(node.children[1].key, "06") == 0);
     tree.map(&leaf, tree.search_leaf("00"));
-    assert(leaf.parent == tree.meta.root_offset);
     assert(leaf.n == 2);
-    assert(bpt::keycmp(leaf.children[0].key, "00") == 0);
-    assert(bpt::keycmp(leaf.children[1].key, "01") == 0);
+    assert(bplus_tree::keycmp(leaf.children[0].key, "00") == 0);
+    assert(bplus_tree::keycmp(leaf.children[1].key, "01") == 0);
     tree.map(&leaf, tree.search_leaf("05"));
-    assert(leaf.parent == tree.meta.root_offset);
     assert(leaf.n == 2);
-    assert(bpt::keycmp(leaf.children[0].key, "02") == 0);
-    assert(bpt::keycmp(leaf.children[1].key, "05") == 0);
+    assert(bplus_tree::keycmp(leaf.children[0].key, "02") == 0);
+    assert(bplus_tree::keycmp(leaf.children[1].key, "05") == 0);
     assert(tree.remove("05") == 0);
     // | 2 7  |
     // | 0 1 | 2 6 | 7 8 9 |
     tree.map(&node, tree.meta.root_offset);
     assert(node.n == 3);
-    assert(bpt::keycmp(node.children[0].key, "02") == 0);
-    assert(bpt::keycmp(node.children[1].key, "07") == 0);
+    assert(bplus_tree::keycmp(node.children[0].key, "02") == 0);
+    assert(bplus_tree::keycmp(node.children[1].key, "07") == 0);
     tree.map(&leaf, tree.search_leaf("04"));
-    assert(leaf.parent == tree.meta.root_offset);
     assert(leaf.n == 2);
-    assert(bpt::keycmp(leaf.children[0].key, "02") == 0);
-    assert(bpt::keycmp(leaf.children[1].key, "06") == 0);
+    assert(bplus_tree::keycmp(leaf.children[0].key, "02") == 0);
+    assert(bplus_tree::keycmp(leaf.children[1].key, "06") == 0);
     tree.map(&leaf, tree.search_leaf("07"));
-    assert(leaf.parent == tree.meta.root_offset);
     assert(leaf.n == 3);
-    assert(bpt::keycmp(leaf.children[0].key, "07") == 0);
-    assert(bpt::keycmp(leaf.children[1].key, "08") == 0);
-    assert(bpt::keycmp(leaf.children[2].key, "09") == 0);
+    assert(bplus_tree::keycmp(leaf.children[0].key, "07") == 0);
+    assert(bplus_tree::keycmp(leaf.children[1].key, "08") == 0);
+    assert(bplus_tree::keycmp(leaf.children[2].key, "09") == 0);
 
     bpt::value_t value;
     assert(tree.search("00", &value) == 0);
@@ -797,7 +978,7 @@ int main(int argc, char *argv[])
 
     {
     bplus_tree tree("test.db");
-    bpt::internal_node_t node;
+    internal_node_t node;
     assert(tree.meta.leaf_node_num == 3);
     assert(tree.meta.internal_node_num == 1);
 
@@ -810,28 +991,28 @@ int main(int argc, char *argv[])
     assert(tree.meta.internal_node_num == 1);
     tree.map(&node, tree.meta.root_offset);
     assert(node.n == 2);
-    assert(bpt::keycmp(node.children[0].key, "07") == 0);
+    assert(bplus_tree::keycmp(node.children[0].key, "07") == 0);
     off_t leaf1_off, leaf2_off;
     leaf1_off = tree.search_leaf("01");
     leaf2_off = tree.search_leaf("07");
     assert(leaf1_off == node.children[0].child);
     assert(leaf2_off == node.children[1].child);
-    bpt::leaf_node_t leaf1, leaf2;
+    leaf_node_t leaf1, leaf2;
     tree.map(&leaf1, leaf1_off);
     tree.map(&leaf2, leaf2_off);
     assert(leaf1.n == 3);
     assert(leaf1.next == leaf2_off);
-    assert(bpt::keycmp(leaf1.children[0].key, "01") == 0);
-    assert(bpt::keycmp(leaf1.children[1].key, "02") == 0);
-    assert(bpt::keycmp(leaf1.children[2].key, "06") == 0);
+    assert(bplus_tree::keycmp(leaf1.children[0].key, "01") == 0);
+    assert(bplus_tree::keycmp(leaf1.children[1].key, "02") == 0);
+    assert(bplus_tree::keycmp(leaf1.children[2].key, "06") == 0);
     assert(leaf2.n == 3);
     assert(leaf2.next == 0);
     assert(tree.remove("09") == 0);
     tree.map(&leaf2, leaf2_off);
     assert(leaf2.n == 2);
     assert(leaf2.next == 0);
-    assert(bpt::keycmp(leaf2.children[0].key, "07") == 0);
-    assert(bpt::keycmp(leaf2.children[1].key, "08") == 0);
+    assert(bplus_tree::keycmp(leaf2.children[0].key, "07") == 0);
+    assert(bplus_tree::keycmp(leaf2.children[1].key, "08") == 0);
     assert(tree.remove("01") == 0);
     assert(tree.remove("08") == 0);
     // |  |
@@ -843,14 +1024,14 @@ int main(int argc, char *argv[])
     off_t offset;
     offset = tree.search_leaf("02");
     assert(offset == node.children[0].child);
-    bpt::leaf_node_t leaf;
+    leaf_node_t leaf;
     tree.map(&leaf, offset);
     assert(leaf.n == 3);
     assert(leaf.next == 0);
     assert(leaf.prev == 0);
-    assert(bpt::keycmp(leaf.children[0].key, "02") == 0);
-    assert(bpt::keycmp(leaf.children[1].key, "06") == 0);
-    assert(bpt::keycmp(leaf.children[2].key, "07") == 0);
+    assert(bplus_tree::keycmp(leaf.children[0].key, "02") == 0);
+    assert(bplus_tree::keycmp(leaf.children[1].key, "06") == 0);
+    assert(bplus_tree::keycmp(leaf.children[2].key, "07") == 0);
 
     PRINT("RemoveWithMerge");
     }
@@ -884,20 +1065,20 @@ int main(int argc, char *argv[])
     assert(tree.meta.leaf_node_num == 4);
     assert(tree.meta.height == 2);
 
-    bpt::internal_node_t node1, node2, root;
+    internal_node_t node1, node2, root;
     tree.map(&root, tree.meta.root_offset);
     off_t node1_off = tree.search_index("0");
     off_t node2_off = tree.search_index("6");
     tree.map(&node1, node1_off);
     tree.map(&node2, node2_off);
     assert(root.n == 2);
-    assert(bpt::keycmp(root.children[0].key, "14") == 0);
+    assert(bplus_tree::keycmp(root.children[0].key, "14") == 0);
     assert(root.children[0].child == node1_off);
     assert(root.children[1].child == node2_off);
     assert(node1.n == 2);
-    assert(bpt::keycmp(node1.children[0].key, "11") == 0);
+    assert(bplus_tree::keycmp(node1.children[0].key, "11") == 0);
     assert(node2.n == 2);
-    assert(bpt::keycmp(node2.children[0].key, "3") == 0);
+    assert(bplus_tree::keycmp(node2.children[0].key, "3") == 0);
     for (int i = 0; i < 6; i++) {
         char key[8] = { 0 };
         sprintf(key, "%d", i);
@@ -930,20 +1111,20 @@ int main(int argc, char *argv[])
     assert(tree.meta.height == 2);
     assert(tree.remove("0") == 0);
     assert(tree.remove("11") == 0);
-    bpt::internal_node_t node1, node2, root;
+    internal_node_t node1, node2, root;
     tree.map(&root, tree.meta.root_offset);
     off_t node1_off = tree.search_index("0");
     off_t node2_off = tree.search_index("6");
     tree.map(&node1, node1_off);
     tree.map(&node2, node2_off);
     assert(root.n == 2);
-    assert(bpt::keycmp(root.children[0].key, "14") == 0);
+    assert(bplus_tree::keycmp(root.children[0].key, "14") == 0);
     assert(root.children[0].child == node1_off);
     assert(root.children[1].child == node2_off);
     assert(node1.n == 2);
-    assert(bpt::keycmp(node1.children[0].key, "11") == 0);
+    assert(bplus_tree::keycmp(node1.children[0].key, "11") == 0);
     assert(node2.n == 2);
-    assert(bpt::keycmp(node2.children[0].key, "3") == 0);
+    assert(bplus_tree::keycmp(node2.children[0].key, "3") == 0);
     // | 14  |
     // | 11  | 3  |
     // | 1 10 | 12 13 | 14 2 | 3 4 5 |
@@ -958,11 +1139,11 @@ int main(int argc, char *argv[])
     assert(tree.meta.internal_node_num == 1);
     assert(tree.meta.leaf_node_num == 3);
     assert(tree.meta.height == 1);
-    bpt::internal_node_t root;
+    internal_node_t root;
     tree.map(&root, tree.meta.root_offset);
     assert(root.n == 3);
-    assert(bpt::keycmp(root.children[0].key, "14") == 0);
-    assert(bpt::keycmp(root.children[1].key, "3") == 0);
+    assert(bplus_tree::keycmp(root.children[0].key, "14") == 0);
+    assert(bplus_tree::keycmp(root.children[1].key, "3") == 0);
     assert(tree.insert("1", 0) != 0);
     assert(tree.insert("2", 0) != 0);
     assert(tree.insert("3", 0) != 0);
@@ -989,7 +1170,7 @@ int main(int argc, char *argv[])
     // | 11 14  | 2 22  | 28  | 6  |
     // | 0 1 10 | 11 12 13 | 14 15 16 | 17 18 19 | 2 20 21 | 22 23 24 | 25 26 27 | 28 29 | 3 4 5 | 6 7 8 9 |
     bplus_tree tree("test.db");
-    bpt::internal_node_t node1, node2, node3, node4, root;
+    internal_node_t node1, node2, node3, node4, root;
     off_t node1_off, node2_off, node3_off, node4_off;
     assert(tree.meta.order == 4);
     assert(tree.meta.internal_node_num == 5);
@@ -1031,21 +1212,21 @@ int main(int argc, char *argv[])
     assert(node4.prev == node3_off);
     assert(node4.next == 0);
     assert(root.n == 4);
-    assert(bpt::keycmp(root.children[0].key, "2") == 0);
-    assert(bpt::keycmp(root.children[1].key, "25") == 0);
-    assert(bpt::keycmp(root.children[2].key, "3") == 0);
+    assert(bplus_tree::keycmp(root.children[0].key, "2") == 0);
+    assert(bplus_tree::keycmp(root.children[1].key, "25") == 0);
+    assert(bplus_tree::keycmp(root.children[2].key, "3") == 0);
     assert(root.children[0].child == node1_off);
     assert(root.children[1].child == node2_off);
     assert(root.children[2].child == node3_off);
     assert(root.children[3].child == node4_off);
     assert(node1.n == 2);
-    assert(bpt::keycmp(node1.children[0].key, "17") == 0);
+    assert(bplus_tree::keycmp(node1.children[0].key, "17") == 0);
     assert(node2.n == 2);
-    assert(bpt::keycmp(node2.children[0].key, "22") == 0);
+    assert(bplus_tree::keycmp(node2.children[0].key, "22") == 0);
     assert(node3.n == 2);
-    assert(bpt::keycmp(node3.children[0].key, "28") == 0);
+    assert(bplus_tree::keycmp(node3.children[0].key, "28") == 0);
     assert(node4.n == 2);
-    assert(bpt::keycmp(node4.children[0].key, "6") == 0);
+    assert(bplus_tree::keycmp(node4.children[0].key, "6") == 0);
 
     PRINT("RemoveWithBorrowInParentRight");
     }
@@ -1121,7 +1302,1254 @@ int main(int argc, char *argv[])
     PRINT("RemoveManyKeysReverse");
     }
 
+    {
+    // a cache of two blocks evicts on almost every access
+    bplus_tree tree("test.db", true, 2);
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+    for (int i = 0; i < size; i += 2) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        assert(tree.remove(key) == 0);
+    }
+    }
+
+    {
+    bplus_tree tree("test.db", false, 64);
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        bpt::value_t value;
+        if (i % 2 == 0) {
+            assert(tree.search(key, &value) != 0);
+        } else {
+            assert(tree.search(key, &value) == 0);
+            assert(value == i);
+        }
+    }
+
+    // hot blocks stay in memory
+    assert(tree.pool.find(tree.meta.root_offset) != NULL);
+    bpt::frame_t *frame = tree.pin(tree.meta.root_offset,
+                                   sizeof(internal_node_t), true);
+    assert(frame->pin == 1 && !frame->dirty);
+    tree.unpin(frame, false);
+    PRINT("BufferPool");
+    }
+
+    for (int i = 0; i < size; i++)
+        numbers[i] = i;
+    std::random_shuffle(numbers, numbers + size);
+
+    {
+    bplus_tree tree("test.db", true, 0, BP_MMAP);
+    assert(tree.base != NULL);
+    char *first = tree.base;
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", numbers[i]);
+        assert(tree.insert(key, numbers[i]) == 0);
+    }
+    for (int i = 0; i < size; i += 3) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.remove(key) == 0);
+    }
+    // the file grows in whole chunks
+    assert(tree.mapped % options.mmap_chunk == 0);
+    assert(tree.mapped >= (size_t)tree.meta.slot);
+    // growing keeps the old mapping for readers inside it, and it sees
+    // the writes made since
+    assert(tree.base != first && tree.retired.size() > 0);
+    assert(tree.retired[0].first == first);
+    off_t leaf = tree.meta.leaf_offset;
+    assert(memcmp(first + leaf, tree.base + leaf,
+                  sizeof(leaf_node_t)) == 0);
+    }
+
+    for (int mode = 0; mode < 2; mode++) {
+    bplus_tree tree("test.db", false, 0, mode ? BP_MMAP : 0);
+    assert((tree.base != NULL) == (mode == 1));
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", i);
+        bpt::value_t value;
+        if (i % 3 == 0) {
+            assert(tree.search(key, &value) != 0);
+        } else {
+            assert(tree.search(key, &value) == 0);
+            assert(value == i);
+        }
+    }
+
+    bpt::key_t left("0010");
+    bpt::value_t values[size];
+    assert(tree.search_range(&left, "0020", values, size) == 8);
+    assert(values[0] == 10 && values[7] == 20);
+    }
+
+    {
+    // options of one tree leave the defaults alone
+    bpt::options_t own = options;
+    own.cache_size = 16;
+    own.mmap_chunk = 64 * 1024;
+    bplus_tree tree("test.db", true, 0, BP_MMAP, own);
+    assert(tree.pool.capacity == 16 && tree.mapped == own.mmap_chunk);
+    assert(bpt::default_options().cache_size == 8);
+    }
+    PRINT("MmapStorage");
+
+    {
+    bplus_tree tree("test.db", true);
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+    off_t slot = tree.meta.slot;
+
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        assert(tree.remove(key) == 0);
+    }
+    assert(tree.meta.free_leaf != 0);
+    assert(tree.meta.free_internal != 0);
+    assert(tree.meta.slot == slot);
+    }
+
+    {
+    // freed blocks survive reopening and are used before growing the file
+    bplus_tree tree("test.db");
+    off_t slot = tree.meta.slot;
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+    assert(tree.meta.slot == slot);
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        bpt::value_t value;
+        assert(tree.search(key, &value) == 0);
+        assert(value == i);
+    }
+
+    for (int round = 0; round < 5; round++) {
+        std::random_shuffle(numbers, numbers + size);
+        for (int i = 0; i < size / 2; i++) {
+            char key[8] = { 0 };
+            sprintf(key, "%d", numbers[i]);
+            assert(tree.remove(key) == 0);
+        }
+        for (int i = 0; i < size / 2; i++) {
+            char key[8] = { 0 };
+            sprintf(key, "%d", numbers[i]);
+            assert(tree.insert(key, numbers[i]) == 0);
+        }
+    }
+    // every block is either in the tree or in a free list
+    size_t free_leaf = 0, free_internal = 0;
+    for (off_t o = tree.meta.free_leaf; o != 0; tree.map(&o, o, sizeof(o)))
+        ++free_leaf;
+    for (off_t o = tree.meta.free_internal; o != 0; tree.map(&o, o, sizeof(o)))
+        ++free_internal;
+    assert((size_t)(tree.meta.slot - bplus_tree::block_start) ==
+           (tree.meta.leaf_node_num + free_leaf +
+            tree.meta.internal_node_num + free_internal) *
+           bplus_tree::block_size);
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        bpt::value_t value;
+        assert(tree.search(key, &value) == 0);
+        assert(value == i);
+    }
+    PRINT("FreeListReuse");
+    }
+
+    {
+    bplus_tree tree("test.db", true);
+    std::random_shuffle(numbers, numbers + size);
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", numbers[i]);
+        assert(tree.insert(key, numbers[i]) == 0);
+    }
+    for (int i = 0; i < size; i += 2) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.remove(key) == 0);
+    }
+    off_t slot = tree.meta.slot;
+    assert(tree.compact() == 0);
+    assert(tree.meta.slot < slot);
+    assert(tree.meta.free_leaf == 0 && tree.meta.free_internal == 0);
+
+    // leaves are full, in key order and next to each other
+    leaf_node_t leaf;
+    off_t offset = tree.meta.leaf_offset;
+    size_t counter = 0;
+    while (offset != 0) {
+        tree.map(&leaf, offset);
+        assert(leaf.n >= tree.meta.order / 2);
+        assert(leaf.next == 0 ||
+               leaf.next == offset + (off_t)bplus_tree::block_size);
+        ++counter;
+        offset = leaf.next;
+    }
+    assert(counter == tree.meta.leaf_node_num);
+    assert(counter == (size_t)(size / 2 + tree.meta.order - 1) /
+                      tree.meta.order);
+    }
+
+    {
+    bplus_tree tree("test.db");
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", i);
+        bpt::value_t value;
+        if (i % 2 == 0) {
+            assert(tree.search(key, &value) != 0);
+            assert(tree.insert(key, i) == 0);
+        } else {
+            assert(tree.search(key, &value) == 0);
+            assert(value == i);
+            assert(tree.remove(key) == 0);
+        }
+    }
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", i);
+        bpt::value_t value;
+        assert((tree.search(key, &value) == 0) == (i % 2 == 0));
+    }
+    assert(tree.compact() == 0);
+
+    // compacted nodes borrow and merge like split ones
+    for (int i = 0; i < size; i += 2) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.remove(key) == 0);
+    }
+    assert(tree.meta.leaf_node_num == 1);
+    PRINT("Compact");
+    }
+
+    for (int fill = 5; fill <= 10; fill += 5) {
+    {
+    bplus_tree tree("test.db", true);
+    bplus_tree::bulk_loader loader(tree, fill / 10.0);
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(loader.add(key, i) == 0);
+    }
+    assert(loader.add("0000", 0) != 0);
+    loader.finish();
+    }
+
+    {
+    bplus_tree tree("test.db");
+    size_t per_leaf = fill == 10 ? 4 : 3;
+    assert(tree.meta.leaf_node_num == (size + per_leaf - 1) / per_leaf);
+    assert(tree.meta.height == (fill == 10 ? 3 : 4));
+
+    leaf_node_t leaf;
+    off_t offset = tree.meta.leaf_offset;
+    off_t last = 0;
+    while (offset != 0) {
+        tree.map(&leaf, offset);
+        assert(leaf.prev == last);
+        assert(leaf.n >= tree.meta.order / 2 && leaf.n <= per_leaf);
+        last = offset;
+        offset = leaf.next;
+    }
+
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", i);
+        bpt::value_t value;
+        assert(tree.search(key, &value) == 0);
+        assert(value == i);
+    }
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.remove(key) == 0);
+    }
+    assert(tree.meta.leaf_node_num == 1);
+    }
+    }
+
+    {
+    // too few records for a second leaf
+    bplus_tree tree("test.db", true);
+    bplus_tree::bulk_loader loader(tree);
+    loader.finish();
+    bpt::value_t value;
+    assert(tree.search("1", &value) != 0);
+    assert(tree.insert("1", 1) == 0);
+    assert(tree.search("1", &value) == 0);
+    PRINT("BulkLoad");
+    }
+
+    {
+    bplus_tree tree("test.db", true);
+    for (int i = 0; i < size; i += 4) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+
+    for (int i = 0; i < size; i++)
+        numbers[i] = i;
+    std::random_shuffle(numbers, numbers + size);
+    record_t records[size + 8];
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", numbers[i]);
+        records[i].key = key;
+        records[i].value = numbers[i];
+    }
+    // repeated keys, only the first one counts
+    for (int i = 0; i < 8; i++) {
+        records[size + i] = records[i];
+        records[size + i].value = -1;
+    }
+    assert(tree.insert_batch(records, size + 8) == size - size / 4);
+    assert(tree.insert_batch(records, size) == 0);
+    }
+
+    {
+    bplus_tree tree("test.db");
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        bpt::value_t value;
+        assert(tree.search(key, &value) == 0);
+        assert(value == i);
+    }
+
+    leaf_node_t leaf;
+    off_t offset = tree.meta.leaf_offset;
+    off_t last = 0;
+    size_t counter = 0;
+    bpt::key_t prev;
+    while (offset != 0) {
+        tree.map(&leaf, offset);
+        assert(leaf.prev == last);
+        assert(leaf.n >= tree.meta.order / 2 && leaf.n <= tree.meta.order);
+        for (size_t i = 0; i < leaf.n; i++) {
+            assert(counter == 0 || bplus_tree::keycmp(prev, leaf.children[i].key) < 0);
+            prev = leaf.children[i].key;
+            ++counter;
+        }
+        last = offset;
+        offset = leaf.next;
+    }
+    assert(counter == size);
+
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        assert(tree.remove(key) == 0);
+    }
+    PRINT("InsertBatch");
+    }
+
+    {
+    bplus_tree tree("test.db", true);
+    for (int i = 0; i < size; i += 2) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+
+    const int probes = 64;
+    bpt::key_t keys[probes];
+    bpt::value_t values[probes];
+    int status[probes];
+    for (int i = 0; i < probes; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%d", rand() % (size + 16));
+        keys[i] = key;
+    }
+    int found = tree.search_many(keys, values, status, probes);
+
+    int expected = 0;
+    for (int i = 0; i < probes; i++) {
+        bpt::value_t value;
+        int ret = tree.search(keys[i], &value);
+        assert(ret == status[i]);
+        if (ret != -1)
+            assert(value == values[i]);
+        if (ret == 0)
+            ++expected;
+    }
+    assert(found == expected);
+    assert(tree.search_many(keys, values, status, 0) == 0);
+    PRINT("SearchMany");
+    }
+
+    {
+    bplus_tree tree("test.db", true);
+    bplus_tree::bulk_loader loader(tree);
+    for (int i = 0; i < size; i++) {
+        char key[8] = { 0 };
+        sprintf(key, "%04d", i * 2);
+        assert(loader.add(key, i * 2) == 0);
+    }
+    loader.finish();
+    }
+
+    {
+    bplus_tree tree("test.db");
+    bplus_tree::cursor c(tree);
+    int counter = 0;
+    for (c.seek_first(); c.valid(); c.next()) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", counter * 2);
+        assert(bplus_tree::keycmp(c.key(), key) == 0);
+        assert(c.value() == counter * 2);
+        ++counter;
+    }
+    assert(counter == size);
+
+    // between two keys, on a key and after the last key
+    assert(c.seek("0011") && c.value() == 12);
+    assert(c.seek("0012") && c.value() == 12);
+    assert(c.next() && c.value() == 14);
+    assert(!c.seek("9999"));
+
+    // pages that end exactly at the end of a leaf
+    bpt::key_t left("0000");
+    bpt::value_t values[4];
+    bool next = true;
+    counter = 0;
+    while (next) {
+        int ret = tree.search_range(&left, "0254", values, 4, &next);
+        for (int i = 0; i < ret; i++)
+            assert(values[i] == (counter++) * 2);
+    }
+    assert(counter == size);
+    PRINT("Cursor");
+    }
+
+    {
+    bplus_tree tree("test.db");
+    bplus_tree::cursor c(tree);
+    int counter = size;
+    for (c.seek_last(); c.valid(); c.prev()) {
+        --counter;
+        assert(c.value() == counter * 2);
+    }
+    assert(counter == 0);
+    assert(!c.prev());
+
+    // from the end, between keys and before the first key
+    assert(!c.seek("9999") && c.prev() && c.value() == (size - 1) * 2);
+    assert(c.seek_before("0011") && c.value() == 10);
+    assert(c.seek_before("0012") && c.value() == 10);
+    assert(c.prev() && c.value() == 8);
+    assert(c.next() && c.value() == 10);
+    assert(!c.seek_before("0000"));
+
+    bpt::key_t keys[8];
+    bpt::value_t values[8];
+    assert(tree.search_before("0101", keys, values, 8) == 8);
+    for (int i = 0; i < 8; i++) {
+        assert(values[i] == 100 - i * 2);
+        char key[8] = { 0 };
+        sprintf(key, "%04d", 100 - i * 2);
+        assert(bplus_tree::keycmp(keys[i], key) == 0);
+    }
+    assert(tree.search_before("0003", keys, values, 8) == 2);
+    assert(tree.search_before("0000", keys, values, 8) == 0);
+    PRINT("ReverseCursor");
+    }
+
+    {
+    bplus_tree tree("test.db", true);
+    assert(tree.insert("t1", 1) == 0);
+    assert(tree.insert("t2", 2) == 0);
+    assert(tree.insert("t3", 3) == 0);
+    assert(tree.insert("t4", 4) == 0);
+
+    // split the leaf but leave the parent alone, like a concurrent insert
+    // does between the two steps
+    leaf_node_t leaf, new_leaf;
+    off_t offset = tree.meta.leaf_offset;
+    tree.map(&leaf, offset);
+    tree.node_create(offset, &leaf, &new_leaf);
+    std::copy(leaf.children + 2, leaf.children + 4, new_leaf.children);
+    new_leaf.n = leaf.n = 2;
+    new_leaf.high = leaf.high;
+    leaf.high = new_leaf.children[0].key;
+    tree.unmap(&new_leaf, leaf.next);
+    tree.unmap(&leaf, offset);
+
+    // the root only knows the first leaf, the rest is to the right of it
+    bpt::value_t value;
+    assert(tree.search("t4", &value) == 0 && value == 4);
+    assert(tree.insert("t5", 5) == 0);
+    assert(tree.search("t5", &value) == 0 && value == 5);
+    assert(tree.search("t1", &value) == 0 && value == 1);
+
+    std::vector<off_t> path(1, tree.meta.root_offset);
+    tree.insert_key_to_index(path, tree.structure_seq, 0, "t3", offset,
+                             leaf.next);
+    internal_node_t root;
+    tree.map(&root, tree.meta.root_offset);
+    assert(root.n == 2);
+    assert(bplus_tree::keycmp(root.children[0].key, "t3") == 0);
+    assert(root.children[1].child == leaf.next);
+    tree.map(&new_leaf, leaf.next);
+    assert(new_leaf.n == 3);
+    PRINT("BLinkRightLink");
+    }
+
+    {
+    bplus_tree tree("test.db", true, 64, BP_THREAD_SAFE);
+    const int threads = 4, keys = size * 16;
+    pthread_t tids[threads + 2];
+    worker_t workers[threads + 2];
+    for (int i = 0; i < threads + 2; i++) {
+        workers[i].tree = &tree;
+        workers[i].id = i;
+        workers[i].threads = threads;
+        workers[i].keys = keys;
+        pthread_create(&tids[i], NULL, i < threads ? concurrent_writer
+                                                   : concurrent_reader,
+                       &workers[i]);
+    }
+    for (int i = 0; i < threads + 2; i++)
+        pthread_join(tids[i], NULL);
+
+    bplus_tree::cursor c(tree);
+    int counter = 0;
+    for (c.seek_first(); c.valid(); c.next(), counter += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%05d", counter);
+        assert(bplus_tree::keycmp(c.key(), key) == 0);
+        assert(c.value() == counter * 2);
+    }
+    assert(counter == keys);
+    assert(tree.meta.leaf_node_num >= (size_t)keys / 2 / tree.meta.order);
+    PRINT("ConcurrentAccess");
+    }
+
+    {
+    bplus_tree tree("test.db", true, 16, BP_THREAD_SAFE);
+    assert(tree.insert("t1", 1) == 0);
+    assert(tree.insert("t3", 3) == 0);
+    off_t offset = tree.descend(NULL, 0, NULL);
+    unsigned long v = tree.optimistic_begin(offset);
+    assert(!(v & 1));
+    bpt::value_t value;
+    assert(tree.search("t3", &value) == 0);
+    assert(value == 3);
+    assert(tree.optimistic_valid(offset, v));
+    assert(tree.insert("t2", 2) == 0);
+    assert(!tree.optimistic_valid(offset, v));
+    v = tree.optimistic_begin(offset);
+    leaf_node_t leaf;
+    tree.map_optimistic(&leaf, offset);
+    assert(leaf.n == 3);
+    assert(tree.optimistic_valid(offset, v));
+    PRINT("OptimisticRead");
+    }
+
+    {
+    bplus_tree tree("test.db", true, 16, BP_THREAD_SAFE);
+    for (int i = 0; i < 64; i++) {
+        char key[16] = { 0 };
+        sprintf(key, "%05d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+
+    // removes that fit in the leaf move no keys to the left
+    unsigned long seq = tree.structure_begin();
+    bplus_tree::cursor c(tree);
+    assert(c.seek("00010") && c.value() == 10);
+    assert(tree.remove("00063") == 0);
+    assert(tree.structure_valid(seq));
+
+    // merges do, the cursor finds its way back by the high key
+    for (int i = 20; i < 60; i++) {
+        char key[16] = { 0 };
+        sprintf(key, "%05d", i);
+        assert(tree.remove(key) == 0);
+    }
+    assert(!tree.structure_valid(seq));
+    int expected = 10;
+    for (; c.valid(); c.next(), ++expected) {
+        if (expected == 20)
+            expected = 60;
+        assert(c.value() == expected);
+    }
+    assert(expected == 63);
+    PRINT("StructureSeq");
+    }
+
+    {
+    bplus_tree tree("test.db", true, 16, BP_THREAD_SAFE);
+    assert(tree.insert("a", 1) == 0);
+    unsigned long readers = 0;
+    pthread_t holder;
+    {
+        bplus_tree::read_scope scope(tree);
+        for (size_t i = 0; i < bplus_tree::reader_slots; i++)
+            readers += tree.readers[i].n;
+        assert(readers == 1);
+
+        // writers don't wait for readers, the exclusive holder does
+        assert(tree.insert("b", 2) == 0);
+        pthread_create(&holder, NULL, exclusive_holder, &tree);
+        while (!__atomic_load_n(&tree.draining, __ATOMIC_ACQUIRE))
+            sched_yield();
+        usleep(1000);
+        assert(tree.draining == 1);
+    }
+    pthread_join(holder, NULL);
+    assert(tree.draining == 0);
+    for (size_t i = 0; i < bplus_tree::reader_slots; i++)
+        assert(tree.readers[i].n == 0);
+    PRINT("ReaderSlots");
+    }
+
+    {
+    // crash in a child: synced inserts come back, half done ones don't
+    for (int round = 0; round < 2; round++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            bplus_tree tree("test.db", round == 0, 8, BP_WAL);
+            tree.set_group_commit(1000, 100000);
+            if (round == 1)
+                tree.wal.begin();
+            for (int i = round; i < size; i += 2) {
+                char key[16] = { 0 };
+                sprintf(key, "%04d", i);
+                assert(tree.insert(key, i) == 0);
+            }
+            if (round == 0)
+                tree.sync();
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    bplus_tree tree("test.db", false, 8, BP_WAL);
+    bplus_tree::cursor c(tree);
+    int counter = 0;
+    for (c.seek_first(); c.valid(); c.next(), counter += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", counter);
+        assert(bplus_tree::keycmp(c.key(), key) == 0);
+        assert(c.value() == counter);
+    }
+    assert(counter == size);
+    assert(tree.insert("0001", 1) == 0);
+    PRINT("WriteAheadLog");
+    }
+
+    {
+    // the file only ever holds whole commits
+    pid_t pid = fork();
+    if (pid == 0) {
+        bplus_tree tree("test.db", true, 8, BP_COW);
+        tree.set_group_commit(1000, 100000);
+        for (int i = 0; i < size; i += 2) {
+            char key[16] = { 0 };
+            sprintf(key, "%04d", i);
+            assert(tree.insert(key, i) == 0);
+        }
+        assert(tree.sync() == 0);
+        assert(tree.last_commit.seq == 2);
+
+        // blocks written back now go to fresh slots
+        for (int i = 1; i < size; i += 2) {
+            char key[16] = { 0 };
+            sprintf(key, "%04d", i);
+            assert(tree.insert(key, i) == 0);
+        }
+        tree.flush();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    {
+    bplus_tree tree("test.db", false, 8, BP_COW);
+    assert(tree.last_commit.seq == 2);
+    bplus_tree::cursor c(tree);
+    int counter = 0;
+    for (c.seek_first(); c.valid(); c.next(), counter += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", counter);
+        assert(bplus_tree::keycmp(c.key(), key) == 0);
+        assert(c.value() == counter);
+    }
+    assert(counter == size);
+
+    // slots of the commit before are reused once the next is on disk
+    off_t end = 0;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < size; i += 2) {
+            char key[16] = { 0 };
+            sprintf(key, "%04d", i);
+            assert(tree.update(key, i + round) == 0);
+            if (i % 16 == 0)
+                assert(tree.sync() == 0);
+        }
+        if (round == 0)
+            end = tree.shadow.end;
+    }
+    assert(tree.shadow.end == end);
+    }
+
+    bplus_tree tree("test.db", false, 8, BP_COW);
+    assert(tree.last_commit.seq > 2);
+    for (int i = 0; i < size; i += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        bpt::value_t value;
+        assert(tree.search(key, &value) == 0 && value == i + 1);
+    }
+    PRINT("ShadowPaging");
+    }
+
+    {
+    // slots freed by a commit are taken again lowest first
+    bpt::shadow_map map(4096);
+    off_t old, slots[6];
+    for (size_t i = 0; i < 6; i++)
+        slots[i] = map.relocate(i, &old);
+    map.committed();
+    map.relocate(5, &old);
+    map.relocate(1, &old);
+    map.relocate(3, &old);
+    map.committed();
+    assert(map.relocate(6, &old) == slots[1]);
+    assert(map.relocate(7, &old) == slots[3]);
+    assert(map.relocate(8, &old) == slots[5]);
+    }
+
+    {
+    // a commit that can't write its blocks leaves the last one alone
+    bplus_tree tree("test.db", true, 8, BP_COW);
+    tree.set_group_commit(100000, 100000);
+    for (int i = 0; i < size; i += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+    assert(tree.sync() == 0);
+    unsigned long seq = tree.last_commit.seq;
+    for (int i = 1; i < size; i += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+
+    int saved = dup(tree.fd);
+    int ro = open("test.db", O_RDONLY);
+    dup2(ro, tree.fd);
+    assert(tree.sync() == -1);
+    assert(tree.last_commit.seq == seq);
+    dup2(saved, tree.fd);
+    close(saved);
+    close(ro);
+    assert(tree.sync() == 0);
+    assert(tree.last_commit.seq == seq + 1);
+    }
+    {
+    bplus_tree tree("test.db", false, 8, BP_COW);
+    for (int i = 0; i < size; i++) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        bpt::value_t value;
+        assert(tree.search(key, &value) == 0 && value == i);
+    }
+    PRINT("CommitWriteError");
+    }
+
+    for (int mode = 0; mode < 2; mode++) {
+    // the last write is made durable without another one after it
+    int flags = mode == 0 ? BP_WAL : BP_COW | BP_THREAD_SAFE;
+    pid_t pid = fork();
+    if (pid == 0) {
+        bplus_tree tree("test.db", true, 8, flags);
+        tree.set_group_commit(1000, 5);
+        assert(tree.insert("0001", 1) == 0);
+        usleep(200000);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    bplus_tree tree("test.db", false, 8, flags);
+    bpt::value_t value;
+    assert(tree.search("0001", &value) == 0 && value == 1);
+    }
+    PRINT("GroupCommitTimer");
+
+    {
+    bplus_tree tree("test.db", true, 8);
+    for (int i = 0; i < size; i += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+
+    pthread_t compactor;
+    compact_job job = { &tree, 1 };
+    {
+    bplus_tree::read_view view = tree.snapshot();
+    assert(tree.snapshots.size() == 1);
+
+    // splits, merges and updates after the snapshot
+    for (int i = 1; i < size; i += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+    for (int i = 0; i < size; i += 4) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.remove(key) == 0);
+        sprintf(key, "%04d", i + 2);
+        assert(tree.update(key, -1) == 0);
+    }
+    bplus_tree::read_view later = tree.snapshot();
+    assert(tree.insert("0000", 0) == 0);
+
+    {
+    bplus_tree::read_view copy = view;
+    bplus_tree::cursor c(copy);
+    int counter = 0;
+    for (c.seek_first(); c.valid(); c.next(), counter += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", counter);
+        assert(bplus_tree::keycmp(c.key(), key) == 0);
+        assert(c.value() == counter);
+    }
+    assert(counter == size);
+    assert(c.seek_last() && c.value() == size - 2);
+    assert(c.prev() && c.value() == size - 4);
+    }
+
+    bpt::value_t value;
+    assert(view.search("0001", &value) == 1 && value == 2);
+    assert(view.search("0004", &value) == 0 && value == 4);
+    assert(later.search("0004", &value) == 1 && value == 5);
+    assert(later.search("0000", &value) == 1 && value == 1);
+    assert(tree.search("0000", &value) == 0 && value == 0);
+    assert(tree.search("0002", &value) == 0 && value == -1);
+
+    bpt::key_t left("0000");
+    bpt::value_t values[size];
+    assert(view.search_range(&left, "9999", values, size) == size / 2);
+    assert(tree.snapshots.size() == 2);
+
+    // saved blocks are in the spill file, not in memory
+    assert(tree.spill_fd != -1 && tree.spill_end > 0);
+    assert((size_t)tree.spill_end / tree.block_size ==
+           tree.spill_refs.size() + tree.spill_free.size());
+    for (size_t i = 0; i < tree.snapshots.size(); i++)
+        assert(tree.snapshots[i]->held.empty());
+
+    // compaction waits for the snapshots to be dropped
+    pthread_create(&compactor, NULL, compact_tree, &job);
+    usleep(20000);
+    assert(__atomic_load_n(&job.ret, __ATOMIC_ACQUIRE) == 1);
+    }
+    pthread_join(compactor, NULL);
+    assert(job.ret == 0);
+    assert(tree.spill_end == 0 && tree.spill_refs.empty());
+    bpt::value_t value;
+    assert(tree.search("0002", &value) == 0 && value == -1);
+    PRINT("SnapshotRead");
+    }
+
+    {
+    {
+    bplus_tree tree("test.db", true, 8, BP_WAL);
+    for (int i = 0; i < size; i += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+    bpt::meta_t meta = tree.get_meta();
+
+    // nothing of an aborted transaction stays
+    assert(tree.commit_transaction() == -1);
+    assert(tree.begin_transaction() == 0);
+    assert(tree.begin_transaction() == -1);
+    for (int i = 1; i < size; i += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+    assert(tree.remove("0000") == 0);
+    bpt::value_t value;
+    assert(tree.search("0001", &value) == 0 && value == 1);
+    assert(tree.search("0000", &value) != 0);
+    assert(tree.sync() == -1);
+    assert(tree.compact() == -1);
+
+    // every block is held once however often it was written
+    bpt::meta_t now = tree.get_meta();
+    assert(tree.dirty_blocks.size() <=
+           now.leaf_node_num + now.internal_node_num + 1);
+
+    // snapshots see what is committed
+    {
+    bplus_tree::read_view view = tree.snapshot();
+    assert(view.search("0001", &value) != 0);
+    assert(view.search("0000", &value) == 0 && value == 0);
+    }
+
+    tree.abort_transaction();
+    assert(tree.dirty_blocks.empty());
+    assert(memcmp(&meta, &tree.meta, sizeof(meta)) == 0);
+    assert(tree.search("0001", &value) != 0);
+    assert(tree.search("0000", &value) == 0 && value == 0);
+
+    assert(tree.begin_transaction() == 0);
+    for (int i = 1; i < size; i += 2) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+    for (int i = 0; i < size; i += 4) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.remove(key) == 0);
+    }
+    assert(tree.commit_transaction() == 0);
+    assert(tree.dirty_blocks.empty());
+    assert(tree.sync() == 0);
+    }
+
+    bplus_tree tree("test.db", false, 8, BP_WAL);
+    bplus_tree::cursor c(tree);
+    int counter = 0;
+    for (c.seek_first(); c.valid(); c.next(), ++counter) {
+        if (counter % 4 == 0)
+            ++counter;
+        char key[16] = { 0 };
+        sprintf(key, "%04d", counter);
+        assert(bplus_tree::keycmp(c.key(), key) == 0);
+        assert(c.value() == counter);
+    }
+    assert(counter == size);
+    PRINT("Transaction");
+    }
+
+    {
+    // a tree of another kind next to the test one, with its own layout
+    typedef bpt::bplus_tree<bpt::key_t, double, 6> other_tree;
+    bplus_tree tree("test.db", true);
+    other_tree other("test2.db", true);
+    assert(other.get_meta().order == 6);
+    assert(other.get_meta().value_size == sizeof(double));
+    assert(other_tree::block_size != bplus_tree::block_size);
+
+    const char *keys[] = { "9", "10", "100", "11" };
+    for (int i = 0; i < 4; i++) {
+        assert(tree.insert(keys[i], i) == 0);
+        assert(other.insert(keys[i], i + 0.5) == 0);
+    }
+
+    // plain string order here, shorter keys first there
+    bplus_tree::cursor c(tree);
+    other_tree::cursor o(other);
+    const char *plain[] = { "10", "100", "11", "9" };
+    const char *shorter[] = { "9", "10", "11", "100" };
+    c.seek_first();
+    o.seek_first();
+    for (int i = 0; i < 4; i++, c.next(), o.next()) {
+        assert(bplus_tree::keycmp(c.key(), plain[i]) == 0);
+        assert(other_tree::keycmp(o.key(), shorter[i]) == 0);
+    }
+    assert(!c.valid() && !o.valid());
+
+    double value;
+    assert(other.search("100", &value) == 0 && value == 2.5);
+    unlink("test2.db");
+    PRINT("TreeTypes");
+    }
+
+    {
+    // the order is picked to fill a page, small nodes share one
+    typedef bpt::bplus_tree<bpt::key_t, bpt::value_t, 0, string_compare>
+            page_tree;
+    assert(page_tree::block_size == BP_PAGE_SIZE);
+    assert(page_tree::order > 4);
+    assert(sizeof(page_tree::internal_node_t) <= BP_PAGE_SIZE);
+    assert(sizeof(page_tree::leaf_node_t) <= BP_PAGE_SIZE);
+    assert(BP_PAGE_SIZE % bplus_tree::block_size == 0);
+    assert(bplus_tree::block_start % bplus_tree::block_size == 0);
+
+    {
+    page_tree tree("test2.db", true);
+    assert(tree.good());
+    assert(tree.meta.order == page_tree::order);
+    assert(tree.meta.page_size == BP_PAGE_SIZE);
+    for (int i = 0; i < 1000; i++) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.insert(key, i) == 0);
+    }
+    assert(tree.meta.leaf_node_num > 2);
+
+    // every node starts a page of its own
+    assert(tree.meta.root_offset % BP_PAGE_SIZE == 0);
+    page_tree::leaf_node_t leaf;
+    for (off_t offset = tree.meta.leaf_offset; offset != 0;
+         offset = leaf.next) {
+        assert(offset % BP_PAGE_SIZE == 0);
+        tree.map(&leaf, offset);
+    }
+    }
+
+    // a tree with other nodes leaves the file alone
+    {
+    bplus_tree tree("test2.db", false, 8);
+    assert(!tree.good());
+    for (int i = 0; i < 500; i++) {
+        char key[16] = { 0 };
+        sprintf(key, "%04d", i);
+        assert(tree.insert(key, i) == -1);
+    }
+    bpt::value_t value;
+    assert(tree.search("0042", &value) == -1);
+    assert(tree.remove("0042") == -1);
+    assert(tree.update("0042", 1) == -1);
+    record_t record = { "1", 1 };
+    assert(tree.insert_batch(&record, 1) == -1);
+    int status;
+    assert(tree.search_many(&record.key, &value, &status, 1) == -1);
+    bpt::key_t left("0");
+    assert(tree.search_range(&left, "9", &value, 1) == -1);
+    bplus_tree::cursor c(tree);
+    assert(!c.seek_first() && !c.seek_last() && !c.valid());
+    bplus_tree::read_view v = tree.snapshot();
+    assert(v.search("0042", &value) == -1);
+    assert(tree.sync() == -1);
+    assert(tree.begin_transaction() == -1);
+    assert(tree.compact() == -1);
+    }
+
+    // so does one that can't open its file
+    {
+    bplus_tree tree("no/such/dir/test.db");
+    assert(!tree.good());
+    assert(tree.insert("1", 1) == -1);
+    bplus_tree::bulk_loader loader(tree);
+    assert(loader.add("1", 1) == -1);
+    loader.finish();
+    }
+
+    page_tree tree("test2.db");
+    assert(tree.good());
+    bpt::value_t value;
+    assert(tree.search("0042", &value) == 0 && value == 42);
+    assert(tree.search("1", &value) != 0);
+    unlink("test2.db");
+    PRINT("PageLayout");
+    }
+
+    {
+    // the bytes of default keys compare like their lengths then strcmp()
+    const char *sorted[] = { "", "9", "a", "\xff", "10", "11", "100", "abc",
+                             "abd", "0123456789abcdef" };
+    const size_t n = sizeof(sorted) / sizeof(sorted[0]);
+    for (size_t i = 0; i < n; i++) {
+        bpt::key_t key(sorted[i]);
+        assert(key.size() == strlen(sorted[i]));
+        assert(memcmp(key.data(), sorted[i], key.size()) == 0);
+        assert(bool(key) == (i > 0));
+        for (size_t j = 0; j < n; j++) {
+            int x = bpt::keycmp(key, sorted[j]);
+            assert(i < j ? x < 0 : i > j ? x > 0 : x == 0);
+            assert((memcmp(key.k, bpt::key_t(sorted[j]).k, 16) < 0) ==
+                   (x < 0));
+        }
+    }
+    // longer strings are cut
+    assert(bpt::keycmp("0123456789abcdefgh", sorted[n - 1]) == 0);
+    PRINT("KeyEncoding");
+    }
+
+    {
+    // every kernel agrees with plain binary search, duplicates included
+    typedef bpt::bplus_tree<> default_tree;
+    std::vector<default_tree::record_t> records;
+    int best = bpt::key_kernel();
+    assert(bpt::set_key_kernel(BP_SCALAR) == 0);
+    assert(bpt::set_key_kernel(-1) == -1);
+    for (int kernel = BP_SCALAR; kernel <= BP_AVX2; kernel++) {
+        if (bpt::set_key_kernel(kernel) != 0)
+            continue;
+        assert(bpt::key_kernel() == kernel);
+        for (size_t n = 0; n < 40; n++) {
+            records.resize(n);
+            for (size_t i = 0; i < n; i++) {
+                char key[16] = { 0 };
+                sprintf(key, "%d", rand() % 50 + (i % 3 == 0 ? 200 : 0));
+                records[i].key = key;
+            }
+            std::sort(records.begin(), records.end(),
+                      default_tree::record_less);
+            for (int k = 0; k < 300; k += 7) {
+                char key[16] = { 0 };
+                sprintf(key, "%d", k);
+                default_tree::record_t *first = records.data();
+                size_t lower = bpt::key_rank(&first->key, sizeof(*first), n,
+                                             key, false);
+                size_t upper = bpt::key_rank(&first->key, sizeof(*first), n,
+                                             key, true);
+                size_t less = 0, not_greater = 0;
+                for (size_t i = 0; i < n; i++) {
+                    less += bpt::keycmp(records[i].key, key) < 0;
+                    not_greater += bpt::keycmp(records[i].key, key) <= 0;
+                }
+                assert(lower == less && upper == not_greater);
+            }
+        }
+    }
+    assert(bpt::set_key_kernel(best) == 0);
+    PRINT("KeyKernels");
+    }
+
+    {
+    // keys of a node are kept apart from children and values
+    typedef bpt::bplus_tree<bpt::key_t, bpt::value_t, 4, string_compare,
+                            bpt::column_nodes> column_tree;
+    typedef bpt::bplus_tree<bpt::key_t, bpt::value_t, 0, bpt::key_compare,
+                            bpt::column_nodes> page_columns;
+    column_tree::leaf_node_t leaf;
+    assert((char *)leaf.children.seconds - (char *)leaf.children.keys ==
+           4 * sizeof(bpt::key_t));
+    assert(page_columns::order >= bpt::bplus_tree<>::order);
+    assert(page_columns::block_size == BP_PAGE_SIZE);
+
+    check_tree<bplus_tree>("test.db", 1000);
+    check_tree<column_tree>("test.db", 1000);
+    check_tree<page_columns>("test.db", 20000);
+    PRINT("ColumnNodes");
+    }
+
+    {
+    // integer keys order as numbers, 0 and negatives included
+    typedef bpt::bplus_tree<bpt::i64_key, bpt::value_t, 4> int_tree;
+    typedef bpt::bplus_tree<bpt::u64_key> page_ints;
+    assert(page_ints::order > bpt::bplus_tree<>::order);
+    assert(!bpt::i64_key() && bpt::i64_key(0) && bpt::u64_key(0));
+    assert(bpt::keycmp(bpt::i64_key(-1), bpt::i64_key(0)) < 0);
+    assert(bpt::keycmp(bpt::u64_key(0), bpt::u64_key(1ULL << 63)) < 0);
+    assert(bpt::u64_key(7).value() == 7 && bpt::i64_key(-7).value() == -7);
+
+    {
+    int_tree tree("test.db", true);
+    for (int i = -501; i < 501; i += 3)
+        assert(tree.insert(i * 1000003LL, i) == 0);
+    assert(tree.insert(0, 0) == 1);
+    assert(tree.insert(INT64_MAX, 1) == 0);
+    for (int i = -501; i < 501; i += 9)
+        assert(tree.remove(i * 1000003LL) == 0);
+
+    // the empty key is refused, a batch holding it is left out whole
+    assert(tree.insert(bpt::i64_key(), 2) == -1);
+    int_tree::record_t batch[2] = { { 7, 7 }, { bpt::i64_key(), 8 } };
+    assert(tree.insert_batch(batch, 2) == -1);
+    bpt::value_t value;
+    assert(tree.search(7, &value) != 0);
+    }
+
+    {
+    bplus_tree tree("test2.db", true);
+    assert(tree.insert("", 1) == -1);
+    bplus_tree::bulk_loader loader(tree);
+    assert(loader.add("", 1) == -1);
+    assert(loader.add("1", 1) == 0);
+    loader.finish();
+    unlink("test2.db");
+    }
+
+    int_tree tree("test.db");
+    bpt::value_t value;
+    assert(tree.search(INT64_MAX, &value) == 0 && value == 1);
+    assert(tree.search(6 * 1000003LL, &value) == 0 && value == 6);
+    assert(tree.search(0, &value) == 0 && value == 0);
+    assert(tree.search(3 * 1000003LL, &value) != 0);
+    int_tree::cursor c(tree);
+    c.seek_first();
+    for (int i = -501; i < 501; i += 3) {
+        if ((i + 501) % 9 == 0)
+            continue;
+        assert(c.valid() && c.key().value() == i * 1000003LL);
+        assert(c.value() == i);
+        c.next();
+    }
+    assert(c.valid() && c.key().value() == INT64_MAX);
+    c.next();
+    assert(!c.valid());
+
+    bpt::i64_key left = -1;
+    bpt::value_t values[8];
+    bool next;
+    assert(tree.search_range(&left, 20000000, values, 8, &next) == 5);
+    assert(values[0] == 0 && values[4] == 18 && !next);
+    PRINT("IntegerKeys");
+    }
+
+    {
+    // leaves keep the first 8 bytes of keys once when all share them
+    typedef bpt::bplus_tree<bpt::key_t, bpt::value_t, 4, bpt::key_compare,
+                            bpt::prefix_nodes> prefix_tree;
+    typedef bpt::bplus_tree<bpt::key_t, bpt::value_t, 0, bpt::key_compare,
+                            bpt::prefix_nodes> page_prefixes;
+    assert(prefix_tree::record_array::type::packed_n == 6);
+    assert(page_prefixes::record_array::type::packed_n >
+           bpt::bplus_tree<>::order * 3 / 2);
+
+    {
+    prefix_tree tree("test.db", true);
+    for (int i = 0; i < 6; i++) {
+        char key[16] = { 0 };
+        sprintf(key, "%d", i * 1000);
+        assert(tree.insert(key, i) == 0);
+    }
+    assert(tree.meta.leaf_node_num == 1);
+
+    // a key of another prefix doesn't fit any more
+    assert(tree.insert("123456789012", 6) == 0);
+    assert(tree.meta.leaf_node_num == 2);
+    bpt::value_t value;
+    assert(tree.search("123456789012", &value) == 0 && value == 6);
+    assert(tree.search("5000", &value) == 0 && value == 5);
+    }
+
+    check_tree<prefix_tree>("test.db", 1000);
+    check_tree<prefix_tree>("test.db", 1000, 1000003);
+    check_tree<page_prefixes>("test.db", 20000);
+    check_tree<page_prefixes>("test.db", 20000, 1000003);
+    PRINT("PrefixNodes");
+    }
+
     unlink("test.db");
+    unlink("test.db.wal");
 
     return 0;
 }